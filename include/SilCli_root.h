@@ -63,17 +63,28 @@ private:
 	TH2F *hbkg;
 	TGraph *gall, *glive;
 	
-	bool fTest, fPause;
+	bool fTest, fPause, fPack; //fPack: packed data replies (SilCodec.h)
 	void *context, *requester;
-	int qtype;
+	int qtype, fMiss; //fMiss: consecutive data requests without reply
+	int sflags;       //server flags (F_RUN, F_PAUSE) of the last batch
+	char fIdent[300]; //socket identity, the server recognises this client after a reconnection
+	int fPort;        //server port: 4747 + ADC number (adc in SilCli.cfg)
 	
 	uint64_t t0, lastts, tall, tdead, lasttall, lasttdead, lastN;
-	uint64_t Nev, Nerr, lastup;
+	uint64_t Nev, Nerr, Nlost, lastup;
+	uint64_t toff; //realtime - monotonic raw clock offset (from anchor records)
+	uint32_t nextseq;
+	bool seqok;
+	uint64_t nextpos; //stream position of the next event to be requested
+	bool posok;
 	uint64_t tpaused;
 	double buffil, Nbuf;
 	struct timeval ti, tp;
 	
+	int Config(const char *fn, char *host, const size_t size);
 	int Query(void *requester, const void *q, const size_t &qlen, void *ans, const size_t &alen, const int &type);
+	void *Open();
+	bool Reopen();
 	void SetupTree();
 	void SetupHistos();
 	void Start();
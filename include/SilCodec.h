@@ -0,0 +1,35 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilPi compact wire encoding of event batches
+
+#ifndef SILCODEC
+#define SILCODEC
+
+#include <stddef.h>
+#include <stdint.h>
+
+//batch encodings (Silbatch.codec on the streaming socket, "codec" request on the REQ/REP one)
+#define SILPI_CODEC_RAW   0          // Silevent records as they are
+#define SILPI_CODEC_PACK  1          // see SilCodec.c
+#define SILPI_CODEC_MAGIC 0x4b434150 // "PACK", first word of a packed frame
+
+//packed frame size for count records, worst case
+#define SILPI_CODEC_BOUND(count) (12 + (size_t)(count) * (2 + sizeof(struct Silevent)))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern size_t codec_encode(const struct Silevent *, const uint32_t, uint8_t *);
+extern int64_t codec_decode(const uint8_t *, const size_t, struct Silevent *, const uint32_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,24 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilServ on-Pi raw event recorder
+
+#ifndef SILREC
+#define SILREC
+
+//recorder configuration (see SilServ.cfg)
+struct reccfg {
+	char dir[500]; // output directory ("" = recorder off)
+	int adc;       // ADC number, in the file names
+	uint64_t size; // new file every size bytes (0 = no limit)...
+	int time;      // ...and/or every time seconds (0 = no limit)
+	int sync;      // data flushed to disk at least every sync seconds
+};
+
+extern int rec_run(struct Silshared *, const struct reccfg *, const int);
+
+#endif
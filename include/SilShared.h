@@ -8,7 +8,25 @@
 #ifndef SILSHARED
 #define SILSHARED
 
-extern struct Silshared *shm_request(const char *, const int);
+extern struct Silshared *shm_request(const char *, const int, const int);
 extern void shm_release(struct Silshared *, const char *, const int); 
+extern int shm_flags(struct Silshared *, const int, const int);
+extern int shm_attach(struct Silshared *, const int);
+extern void shm_detach(struct Silshared *, const int);
+extern uint32_t shm_free(struct Silshared *);
+extern uint32_t shm_used(struct Silshared *);
+extern void shm_spectrum(struct Silshared *, const uint32_t, const uint64_t);
+extern void shm_spool(const int);
+extern int shm_spill(struct Silshared *);
+extern uint32_t shm_count(struct Silshared *, const int);
+extern uint32_t shm_peek(struct Silshared *, const int, struct Silevent *, const uint32_t, uint64_t *);
+extern void shm_ack(struct Silshared *, const int, uint64_t);
+extern uint32_t shm_read(struct Silshared *, const int, struct Silevent *, const uint32_t);
+extern void shm_flush(struct Silshared *, const int);
+
+extern struct Silring *dev_map(const int);
+extern void dev_unmap(struct Silring *);
+extern int dev_read(const int, struct Silring *, struct Silevent *, const int);
+extern int dev_to_shm(const int, struct Silring *, struct Silshared *);
 
 #endif
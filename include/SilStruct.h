@@ -8,13 +8,17 @@
 #ifndef SILPISTRUCT
 #define SILPISTRUCT
 
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
 #define SIZE 10000
 
 //data flags
 #define F_RUN   1
 #define F_PAUSE 2
-#define F_WBUSY 4
-#define F_RBUSY 8
 
 //error mask bits
 #define SILPI_EIDLE_LVE      1
@@ -22,15 +26,153 @@
 #define SILPI_EIDLE_NOTIME   4
 #define SILPI_EDEAD_LVE      8
 
+//record types and format version
+#define SILPI_REC_EVENT   0
+#define SILPI_REC_ANCHOR  1
+#define SILPI_REC_VERSION 2
+
 //data structure to user space
-struct Silevent { //128-bit events
-	uint64_t ts; // event timestamp (in ns from 1/1/1970) registered at conversion start
+struct Silevent { //192-bit records
+	uint64_t ts; // event timestamp (in ns, CLOCK_MONOTONIC_RAW) registered at conversion start
 	uint32_t dt; // total dead time: conversion time (due to Silena ADC) + reading time (due to Raspberry Pi)
 	uint16_t val, emask; // event value and error bitmask;
+	uint32_t seq; // record sequence number (a gap means lost records)
+	uint16_t type, ver; // record type (SILPI_REC_*) and format version (SILPI_REC_VERSION)
+};
+
+//realtime anchor (type = SILPI_REC_ANCHOR), periodically written among the events
+//UTC time of the following events (in ns from 1/1/1970) is ts + (rt - anchor ts)
+struct Silanchor {
+	uint64_t ts; // CLOCK_MONOTONIC_RAW (ns)
+	uint64_t rt; // CLOCK_REALTIME (ns from 1/1/1970), sampled right after ts
+	uint32_t seq;
+	uint16_t type, ver;
+};
+
+//event ring header, mapped by user space at the beginning of /dev/silena (see mmap)
+struct Silring {
+	uint32_t size;      // ring capacity (in events)
+	uint32_t offset;    // position of the first event from the beginning of the mapping (in bytes)
+	uint32_t write_idx; // next slot to be filled (updated only by the driver)
+	uint32_t read_idx;  // next slot to be read (updated only by the consumer)
+	uint32_t hanged;    // set by the driver when an event is waiting for free slots
+};
+
+//wake-up threshold for blocking read() and poll() on /dev/silena
+struct Silwatermark {
+	uint32_t events;  // wake up when at least this number of events is in the ring (default 1)...
+	uint32_t timeout; // ...or when unread events have been waiting for timeout us (0 = no timeout)
+};
+
+//pulse-height spectrum accumulated by the driver in spectrum mode
+//it is read with read() or mapped at offset SILPI_SPEC_OFFSET of /dev/silena
+#define SILPI_SPEC_BINS   65536
+#define SILPI_SPEC_OFFSET 0x40000000
+struct Silspectrum {
+	uint64_t events;  // accumulated events
+	uint64_t errors;  // accumulated events with non-zero error mask
+	uint64_t tstart;  // conversion start of the first event (same clock as Silevent.ts)
+	uint64_t tstop;   // end of the dead time of the last event
+	uint64_t dead;    // total dead time (in ns), live time = tstop - tstart - dead
+	uint32_t bins[SILPI_SPEC_BINS];
+};
+
+//acquisition modes
+#define SILPI_MODE_EVENTS   0 // every event goes to the ring (default)
+#define SILPI_MODE_SPECTRUM 1 // events are only accumulated in the spectrum
+
+//device ioctl commands
+#define SILPI_IOC_MAGIC     'S'
+#define SILPI_IOC_RECOVER   _IO(SILPI_IOC_MAGIC, 1) // read the event pending on a hanged ring
+#define SILPI_IOC_WATERMARK _IOW(SILPI_IOC_MAGIC, 2, struct Silwatermark)
+#define SILPI_IOC_MODE      _IO(SILPI_IOC_MAGIC, 3) // argument: SILPI_MODE_*
+#define SILPI_IOC_CLEAR     _IO(SILPI_IOC_MAGIC, 4) // reset spectrum and time counters (EBUSY while running)
+
+//event batches on the SilServ streaming socket (PUSH or PUB, see SilServ.cfg) and replies to "get" requests
+//each message has two frames: this header and count events (size bytes, raw or packed, see SilCodec.h)
+#define SILPI_BATCH_MAGIC 0x424c4953 // "SILB"
+struct Silbatch {
+	uint32_t magic;  // SILPI_BATCH_MAGIC
+	uint16_t ver;    // SILPI_REC_VERSION
+	uint16_t adc;    // ADC number (/dev/silena<n>)
+	uint64_t seq;    // batch number, from 0 at server start (at the first request for "get" replies)
+	uint64_t first;  // stream position of the first event (ahead of the expected one if events were dropped)
+	uint64_t time;   // server time at send (ns from 1/1/1970)
+	uint32_t count;  // events in the second frame
+	int32_t flags;   // F_RUN, F_PAUSE
+	uint32_t codec;  // SILPI_CODEC_RAW or SILPI_CODEC_PACK
+	uint32_t size;   // bytes in the second frame
+	uint32_t backlog; // events still waiting for this client after this batch
+	uint32_t occ;    // events held in the shared ring (SIZE at most), see shm_used
+};
+
+//consumers of the shared ring (clients of SilServ, streaming socket)
+#define SILPI_MAXCONS    8
+#define SILPI_CONS_BLOCK 1 // the acquisition pauses when the ring is full
+#define SILPI_CONS_DROP  2 // more than SIZE/2 events behind, the oldest events are skipped
+
+struct Silcursor {
+	uint64_t pos __attribute__((aligned(64))); // next event to be read (moved by the consumer, or by the reader to drop events)
+	uint64_t dropped; // events skipped by the reader (DROP policy)
+	int policy;       // 0 = free cursor, SILPI_CONS_BLOCK or SILPI_CONS_DROP
+};
+
+//pulse-height spectrum accumulated by SilServ from the event stream (in events mode, see shm_spectrum)
+//each bin remembers the version of its last change: clients ask only for the bins changed since their version
+struct Silspecshm {
+	uint64_t version; // updates published by the reader (written last)
+	uint64_t reset;   // version of the last clear
+	int clear;        // clear requested by the 0MQ server ("specclear"), done by the reader
+	struct Silspectrum spec;       // counts and live/dead time totals
+	uint32_t ver[SILPI_SPEC_BINS]; // version of the last change of each bin
+};
+
+//reply to "spec <version>": this header, then count Silspecbin records (bins changed after version)
+#define SILPI_SPEC_MAGIC 0x43455053 // "SPEC"
+struct Silspecdelta {
+	uint32_t magic;   // SILPI_SPEC_MAGIC
+	uint16_t ver;     // SILPI_REC_VERSION
+	uint16_t adc;     // ADC number (/dev/silena<n>)
+	uint64_t version; // the next request is "spec <version>"
+	uint32_t full;    // 1: the spectrum was cleared after the requested version, the old one has to be dropped
+	uint32_t count;   // records in the second frame
+	uint64_t events, errors, tstart, tstop, dead; // totals, as in Silspectrum
+};
+struct Silspecbin {
+	uint32_t bin;   // ADC value
+	uint32_t count; // current content (not an increment: a repeated reply does no harm)
+};
+
+//device reader counters, exported by the 0MQ server ("metrics" request, see SilServ.cfg)
+//written by the reader once a second (occmax at every read)
+struct Silstats {
+	uint64_t events;  // events read from the device
+	uint64_t rate;    // events read in the last second
+	uint64_t pauses;  // acquisition paused because the ring was full
+	uint64_t paused;  // time with the acquisition paused (ns), also dead time of the spectrum
+	uint64_t spooled; // events moved to the spool file
+	uint64_t cpu;     // CPU time of the reader (ns)
+	uint32_t occ;     // events held in the ring
+	uint32_t occmax;  // highest occupancy since start
+	uint64_t retunes; // device watermark changes of the read scheduler
+	uint32_t wm_events, wm_timeout; // current device watermark (events, us), see sched_update in SilServ.c
+	uint32_t interval; // read interval without watermark support (ms)
+	uint32_t latency;  // read latency target (us)
+	uint32_t runlat, runlatmax; // start/stop request to ADC gate latency, last and highest (us)
 };
 
+//shared memory between the device reader and the 0MQ server of SilServ
+//single-producer/multi-consumer ring retaining the events until every consumer has read them:
+//head and cursors only grow (unread events = head - pos, slot = index % SIZE), see shm_free and shm_read
 struct Silshared {
-	int size, flags;
+	int flags; // F_RUN, F_PAUSE (changed with shm_flags)
+	uint64_t runcmd; // CLOCK_MONOTONIC time (ns) of the last start/stop request, stored before F_RUN changes
+	uint64_t head __attribute__((aligned(64))); // events written, moved by the device reader only
+	uint64_t spill; // events before this position may have left the ring: they are in the spool file (see shm_spill)
+	uint64_t spoolbase; // stream position of the first event in the spool file (offset = (pos - spoolbase) * event size)
+	struct Silcursor cons[SILPI_MAXCONS];
+	struct Silstats stats;
+	struct Silspecshm specs;
 	struct Silevent buffer[SIZE];
 };
 
@@ -0,0 +1,263 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilPi driver core - acquisition FSM and event ring handling
+// This file is included by the kernel module (mod/SilPi.c) and by the user space
+// harness (src/SilBench.c). The includer defines FATAL and DEBUG and the hw_* hooks
+// below: the module drives real GPIO lines, the harness simulated ones.
+
+#ifndef SILPICORE
+#define SILPICORE
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+// kernel primitives used by the core
+#define READ_ONCE(x)            (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)        (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define NSEC_PER_SEC 1000000000LL
+#endif
+
+#include "../include/SilStruct.h"
+
+#define ANCHOR_NS NSEC_PER_SEC  /* interval between realtime anchor records */
+#define NDATA 13                /* number of data lines */
+
+// FSM states
+#define SILPI_IDLE  0
+#define SILPI_DEAD  1
+
+struct silcore {
+	int state, old_lve;
+	uint64_t lt1, lt2;        // dead time start and end (ns, CLOCK_MONOTONIC_RAW)
+	uint16_t val, emask;
+	uint32_t size;            // ring capacity (private copy of ring->size)
+	uint32_t write_idx;       // private copy of ring->write_idx (user space can write on the mapping)
+	uint32_t seq;             // sequence number of the next record
+	uint64_t last_anchor;     // timestamp of the last realtime anchor
+	struct Silring *ring;     // ring header, shared with user space
+	struct Silevent *events;  // ring slots
+	int mode;                 // SILPI_MODE_EVENTS or SILPI_MODE_SPECTRUM
+	struct Silspectrum *spec; // spectrum mode accumulator
+	uint16_t lev_lut[4][256]; // level register bytes -> ADC bits
+	// counters (reset with the core)
+	uint64_t stalls;          // full ring occurrences
+	uint64_t lve_glitches, rdy_glitches;
+	uint64_t bad_lve, bad_rdy;
+};
+
+// hooks provided by the includer
+static uint16_t hw_data(struct silcore *core);               // data lines D12...D00 as read (active low)
+static void hw_ack(struct silcore *core, int64_t t_irq);     // raise ACK (t_irq = RDY handler entry, 0 = recovery)
+static void hw_stored(struct silcore *core, uint32_t count); // new records in the ring (count = unread events)
+static void hw_hanged(struct silcore *core);                 // full ring: set ring->hanged and wake up the reader
+static uint64_t hw_clock_raw(void);                          // CLOCK_MONOTONIC_RAW (ns)
+static uint64_t hw_clock_real(void);                         // CLOCK_REALTIME (ns)
+
+// new acquisition: empty ring and spectrum, FSM waiting for the first LVE edge
+static inline void core_reset(struct silcore *core) {
+	core->write_idx       = 0;
+	core->ring->write_idx = 0;
+	core->ring->read_idx  = 0;
+	core->ring->hanged    = 0;
+	core->seq             = 0;
+	core->last_anchor     = 0;
+	core->mode            = SILPI_MODE_EVENTS;
+	core->stalls          = 0;
+	core->lve_glitches    = 0;
+	core->rdy_glitches    = 0;
+	core->bad_lve         = 0;
+	core->bad_rdy         = 0;
+	core->state           = SILPI_DEAD;
+	core->emask           = 0;
+	core->old_lve         = 0;
+	memset(core->spec, 0, sizeof(struct Silspectrum));
+}
+
+// lookup tables translate each byte of the level register into its share of ADC bits
+static inline int core_setup_lut(struct silcore *core, const int *pins) {
+	int j, v;
+	
+	memset(core->lev_lut, 0, sizeof(core->lev_lut));
+	for(j=0; j<NDATA; j++) {
+		if(pins[j] < 0 || pins[j] >= 32) {
+			FATAL("GPIO %d is not in the first bank\n", pins[j]);
+			return -EINVAL;
+		}
+		for(v=0; v<256; v++) {
+			if(v & (1 << (pins[j] % 8))) core->lev_lut[pins[j] / 8][v] |= (uint16_t)(1 << j);
+		}
+	}
+	return 0;
+}
+
+// all data lines from a single level register read
+static inline uint16_t core_levels(struct silcore *core, uint32_t lev) {
+	return core->lev_lut[0][lev & 0xff] | core->lev_lut[1][(lev >> 8) & 0xff] | core->lev_lut[2][(lev >> 16) & 0xff] | core->lev_lut[3][lev >> 24];
+}
+
+static inline void read_event(struct silcore *core) {
+	int val = hw_data(core);
+	
+	if((val^=0x1fff) < 2) val = 2;
+	core->val = (uint16_t)val;
+	return;
+}
+
+// number of unread events
+static inline uint32_t ring_count(struct silcore *core) {
+	uint32_t read_idx = READ_ONCE(core->ring->read_idx);
+	
+	if(core->write_idx >= read_idx) return core->write_idx - read_idx;
+	return core->write_idx + core->size - read_idx;
+}
+
+// spectrum mode: nothing goes to the ring, which never fills
+static inline void fill_spectrum(struct silcore *core) {
+	struct Silspectrum *spec = core->spec;
+	
+	spec->bins[core->val]++;
+	spec->events++;
+	if(core->emask) spec->errors++;
+	if(spec->tstart == 0) spec->tstart = core->lt1;
+	spec->tstop = core->lt2;
+	spec->dead += core->lt2 - core->lt1;
+	return;
+}
+
+static inline void fill_event(struct silcore *core) {
+	uint32_t write_idx = core->write_idx;
+	struct Silanchor *anchor;
+	
+	if(core->mode == SILPI_MODE_SPECTRUM) {
+		fill_spectrum(core);
+		return;
+	}
+	
+	// event timestamps use the raw monotonic clock, a realtime anchor is added every ANCHOR_NS
+	// (only if two slots are free: core_rdy checked just the one for the event)
+	if(core->lt2 - core->last_anchor >= ANCHOR_NS && ring_count(core) + 2 < core->size) {
+		anchor = (struct Silanchor *)&(core->events[write_idx]);
+		anchor->ts   = hw_clock_raw();
+		anchor->rt   = hw_clock_real();
+		anchor->seq  = core->seq++;
+		anchor->type = SILPI_REC_ANCHOR;
+		anchor->ver  = SILPI_REC_VERSION;
+		core->last_anchor = anchor->ts;
+		if(++write_idx == core->size) write_idx = 0;
+	}
+	
+	// filling data event structure
+	core->events[write_idx].ts     = core->lt1;
+	core->events[write_idx].dt     = (uint32_t)(core->lt2 - core->lt1);
+	core->events[write_idx].val    = core->val;
+	core->events[write_idx].emask  = core->emask;
+	core->events[write_idx].seq    = core->seq++;
+	core->events[write_idx].type   = SILPI_REC_EVENT;
+	core->events[write_idx].ver    = SILPI_REC_VERSION;
+	
+	// setting new write index (the event must be visible before the index)
+	if(++write_idx == core->size) write_idx = 0;
+	smp_store_release(&(core->write_idx), write_idx);
+	smp_store_release(&(core->ring->write_idx), write_idx);
+	
+	hw_stored(core, ring_count(core));
+	return;
+}
+
+// LVE edge (lve = line level after the edge, ts = IRQ timestamp)
+static inline void core_lve(struct silcore *core, uint64_t ts, int lve) {
+	//checking IRQ coherence and glitches
+	if(lve == core->old_lve) {
+		core->lve_glitches++;
+		DEBUG("LVE transition glitch detected (state = %s, LVE: %d -> %d)\n", core->state == SILPI_IDLE ? "IDLE" : "DEAD", core->old_lve, lve);
+		return;
+	}
+	core->old_lve = lve;
+	
+	switch(core->state) {
+		case SILPI_IDLE:
+			if(lve) {
+				FATAL("Bad LVE transition detected (state = IDLE, LVE: 0 -> 1)\n");
+				core->bad_lve++;
+				core->emask = SILPI_EIDLE_LVE;
+			}
+			else {
+				core->emask = 0;
+				core->val   = 65535;
+				core->lt1   = ts;
+				core->state = SILPI_DEAD;
+			}
+			break;
+		case SILPI_DEAD:
+			if(lve) {
+				core->lt2   = ts;
+				core->state = SILPI_IDLE;
+				fill_event(core);
+			}
+			else {
+				FATAL("Bad LVE transition detected (state = DEAD, LVE: 1 -> 0)\n");
+				core->bad_lve++;
+				core->emask |= SILPI_EDEAD_LVE;
+			}
+	}
+	return;
+}
+
+// RDY falling edge (rdy = line level, t_irq = handler entry time for the ACK latency)
+static inline void core_rdy(struct silcore *core, int64_t t_irq, int rdy) {
+	uint32_t next_idx;
+	
+	if(rdy) {
+		core->rdy_glitches++;
+		DEBUG("RDY transition glitch detected (state = %s, RDY = 1)\n", core->state == SILPI_IDLE ? "IDLE" : "DEAD");
+		return;
+	}
+	
+	if(core->state == SILPI_IDLE) {
+		FATAL("Bad RDY transition detected (state = IDLE, RDY: ? -> %d)\n", rdy);
+		core->bad_rdy++;
+		core->emask = SILPI_EIDLE_NOTIME | SILPI_EIDLE_RDYIRQ;
+		core->lt1   = hw_clock_raw();
+		core->state = SILPI_DEAD;
+	}
+	
+	// the ADC is left waiting for ACK until a slot is free
+	next_idx = core->write_idx + 1;
+	if(next_idx == core->size) next_idx = 0;
+	if(next_idx == smp_load_acquire(&(core->ring->read_idx))) {
+		DEBUG("buffer hanged\n");
+		core->stalls++;
+		hw_hanged(core);
+	}
+	else {
+		read_event(core);
+		hw_ack(core, t_irq);
+	}
+	return;
+}
+
+// reading the event left pending by core_rdy when the ring was full (RDY still low)
+static inline void core_pending(struct silcore *core) {
+	read_event(core);
+	hw_ack(core, 0);
+	if(core->state == SILPI_IDLE) {
+		core->state = SILPI_DEAD;
+		core->emask = SILPI_EIDLE_NOTIME;
+		core->lt1   = hw_clock_raw();
+	}
+	return;
+}
+
+#endif
@@ -8,6 +8,7 @@
 
 //module creation functions
 #include <linux/module.h>
+#include <linux/version.h>
 //device creation functions
 #include <linux/device.h>
 #include <linux/cdev.h>
@@ -17,12 +18,26 @@
 #include <linux/interrupt.h>
 //GPIO access
 #include <linux/gpio.h>
+#include <linux/io.h>
 //time measurement and sleeping
 #include <linux/ktime.h>
 #include <linux/timekeeping.h>
 #include <linux/delay.h>
+//event ring allocation and mapping to user space
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+//blocking read and poll
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+//latency histograms
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 //Data structure
 #include "../include/SilStruct.h"
+//static tracepoints (latency and occupancy profiling)
+#define CREATE_TRACE_POINTS
+#include "SilPi_trace.h"
 
 MODULE_LICENSE("GPL v2");
 
@@ -32,19 +47,31 @@ MODULE_LICENSE("GPL v2");
 #define FATAL(frm,...) printk(KERN_ALERT "%s:%s - " frm, HERE, ##__VA_ARGS__ )
 #define DEBUG(frm,...) if(debug) printk(KERN_ALERT "%s:%s - " frm, HERE, ##__VA_ARGS__ )
 #define BASE_MINOR 0
+#define MAXDEV 4                /* maximum number of ADCs (one minor each) */
 #define EVENTSIZE sizeof(struct Silevent)
+#define RING_MAX (1U << 24)     /* maximum ring capacity (events) */
+#define ACK_BINS 64             /* RDY to ACK latency histogram: number of bins... */
+#define ACK_BIN_NS 250          /* ...and bin width (ns), last bin collects overflows */
 
-// FSM states
-#define SILPI_IDLE  0
-#define SILPI_DEAD  1
-
-// GPIO mapping
-#define RUN 23                  /* OUT - RUN/STOP          (active high) */
-#define ENB 24                  /* OUT - ADC enable        (active high) */
-#define LVE 25                  /*  IN - live time monitor (active  low) */
-#define RDY 26                  /*  IN - data ready        (active  low) */
-#define ACK 27                  /* OUT - data accepted     (active high) */
-static struct gpio gpios[] = {
+// debug can be switched on/off with "echo 1/0 > /sys/modules/SilMod/parameters/debug"
+static int debug = 0;
+module_param (debug, int, S_IRUGO | S_IWUSR);
+
+// acquisition FSM and event ring, shared with the user space harness (src/SilBench.c)
+#include "SilCore.h"
+
+// GPIO mapping: data lines D00-D12 first, then control lines (positions in the gpio table)
+#define RUN 13                  /* OUT - RUN/STOP          (active high) */
+#define ENB 14                  /* OUT - ADC enable        (active high) */
+#define LVE 15                  /*  IN - live time monitor (active  low) */
+#define RDY 16                  /*  IN - data ready        (active  low) */
+#define ACK 17                  /* OUT - data accepted     (active high) */
+#define NGPIO 18                /* size of the gpio table */
+#define PIN(ddata, line) ((ddata)->gpios[line].gpio)
+#define GPLEV0 0x34             /* pin level register for GPIO 0-31 (BCM2835/BCM2711) */
+
+// default mapping (first ADC), other mappings are given with the gpiomap parameter
+static const struct gpio default_gpios[NGPIO] = {
 	{  4, GPIOF_IN, "D00" },            /* pin  7 */
 	{  5, GPIOF_IN, "D01" },            /* pin 29 */
 	{  6, GPIOF_IN, "D02" },            /* pin 31 */
@@ -59,11 +86,11 @@ static struct gpio gpios[] = {
 	{ 18, GPIOF_IN, "D11" },            /* pin 12 */
 	{ 19, GPIOF_IN, "D12" },            /* pin 35 */
 	
-	{RUN, GPIOF_OUT_INIT_LOW, "RUN" },  /* pin 16 - RUN/STOP */
-	{ENB, GPIOF_OUT_INIT_LOW, "ENB" },  /* pin 18 - ENABLE */
-	{LVE, GPIOF_IN, "LVE" },            /* pin 22 - LIVE TIME */
-	{RDY, GPIOF_IN, "RDY" },            /* pin 37 - READY */
-	{ACK, GPIOF_OUT_INIT_LOW, "ACK" },  /* pin 13 - ACCEPT */
+	{ 23, GPIOF_OUT_INIT_LOW, "RUN" },  /* pin 16 - RUN/STOP */
+	{ 24, GPIOF_OUT_INIT_LOW, "ENB" },  /* pin 18 - ENABLE */
+	{ 25, GPIOF_IN, "LVE" },            /* pin 22 - LIVE TIME */
+	{ 26, GPIOF_IN, "RDY" },            /* pin 37 - READY */
+	{ 27, GPIOF_OUT_INIT_LOW, "ACK" },  /* pin 13 - ACCEPT */
 };
 
 // Device data
@@ -71,128 +98,206 @@ static dev_t device  = 0;
 static struct cdev cdev;
 static int cdev_flag = 0;
 static struct class *dev_class   = NULL;
-static struct device *dev_device = NULL;
+static struct dentry *dbg_dir    = NULL;
 
 struct driver_data {
-	int rdy_irq, lve_irq, state;
-	int old_lve;
-	ktime_t lt1, lt2;
-	uint16_t val, emask;
-	atomic_t a_write_idx;
-	atomic_t a_read_idx;
-	struct Silevent events[SIZE];
+	int minor;
+	atomic_t busy;            // the ADC can be opened only once
+	struct gpio gpios[NGPIO];
+	struct device *dev;
+	int rdy_irq, lve_irq;
+	struct silcore core;      // FSM state, ring (slots start from the page after the header) and spectrum
+	unsigned long ring_bytes; // size of the mappable area
+	unsigned long spec_bytes;
+	wait_queue_head_t wq;     // readers waiting for the watermark
+	struct hrtimer wm_timer;  // watermark timeout
+	uint32_t wm_events;       // watermark (events)
+	ktime_t wm_timeout;       // watermark timeout (0 = disabled)
+	int wm_expired;           // timeout expired for the events currently in the ring
+	void __iomem *gplev;      // mapped level register (NULL = single pin reading)
+	// counters (reset at open, see sysfs attributes, the others are in core)
+	uint64_t stall_ns;        // time spent with a full ring (ADC waiting for ACK)
+	ktime_t stall_start;
+	struct hrtimer ack_timer; // end of acknowledgement signal
+	uint32_t ack_hist[ACK_BINS];
 };
+static struct driver_data sildev[MAXDEV];
 
-// debug can be switched on/off with "echo 1/0 > /sys/modules/SilMod/parameters/debug"
-static int debug = 0;
-module_param (debug, int, S_IRUGO | S_IWUSR);
+// physical address of the GPIO block (0x3f200000 on RPi 3, 0xfe200000 on RPi 4)
+// if given, data lines are sampled with a single register read, otherwise pin by pin
+static ulong gpio_base = 0;
+module_param (gpio_base, ulong, S_IRUGO);
+
+// event ring capacity, allocated at module load
+static uint ring_size = SIZE;
+module_param (ring_size, uint, S_IRUGO);
+
+// width of the acknowledgement signal (ns)
+static uint ack_ns = 1000;
+module_param (ack_ns, uint, S_IRUGO | S_IWUSR);
+
+// one ADC for each gpiomap entry (/dev/silena, /dev/silena1, ...), each with its own IRQs and ring
+// an entry lists 18 GPIO numbers: D00,...,D12,RUN,ENB,LVE,RDY,ACK (default: one ADC with default_gpios)
+static char *gpiomap[MAXDEV];
+static int ndev = 0;
+module_param_array (gpiomap, charp, &ndev, S_IRUGO);
+
+int parse_gpiomap(struct driver_data *ddata, const char *map) {
+	char buffer[128], *str = buffer, *tok;
+	unsigned int pin;
+	int j = 0;
+	
+	if(strscpy(buffer, map, sizeof(buffer)) < 0) return -EINVAL;
+	while((tok = strsep(&str, ",")) != NULL) {
+		if(j >= NGPIO || kstrtouint(tok, 10, &pin)) return -EINVAL;
+		ddata->gpios[j++].gpio = pin;
+	}
+	return (j == NGPIO) ? 0 : -EINVAL;
+}
 
-void read_event(struct driver_data *ddata) {
-	int j, val=0;
+// data lines sampled with a single read of the level register
+int setup_fastread(struct driver_data *ddata) {
+	int j, pins[NDATA];
 	
-	for(j=12; j>=0; j--) {
-		val = (val<<1) + gpio_get_value(gpios[j].gpio);
+	for(j=0; j<NDATA; j++) pins[j] = PIN(ddata, j);
+	if(core_setup_lut(&(ddata->core), pins)) return -EINVAL;
+	
+	ddata->gplev = ioremap(gpio_base + GPLEV0, sizeof(uint32_t));
+	if(ddata->gplev == NULL) {
+		FATAL("can't map level register at 0x%lx\n", gpio_base + GPLEV0);
+		return -ENOMEM;
 	}
-	if((val^=0x1fff) < 2) val = 2;
+	DEBUG("level register mapped at 0x%lx\n", gpio_base + GPLEV0);
+	return 0;
+}
+
+// core hooks: ddata is the container of the core
+static uint16_t hw_data(struct silcore *core) {
+	struct driver_data *ddata = container_of(core, struct driver_data, core);
+	int j;
+	uint16_t val=0;
 	
-	ddata->val = (uint16_t)val;
-	return;
+	// all data lines sampled at once
+	if(ddata->gplev) return core_levels(core, readl(ddata->gplev));
+	
+	for(j=NDATA-1; j>=0; j--) {
+		val = (val<<1) + gpio_get_value(PIN(ddata, j));
+	}
+	return val;
 }
 
-void send_ack(struct driver_data *ddata) {
+// ACK is raised here and dropped by ack_timer, so the IRQ handler never spins
+static void hw_ack(struct silcore *core, int64_t t_irq) {
+	struct driver_data *ddata = container_of(core, struct driver_data, core);
+	s64 latency = -1;
+	
 	// start of acknowledgement signal
-	gpio_set_value(ACK, 1);
+	gpio_set_value(PIN(ddata, ACK), 1);
+	hrtimer_start(&(ddata->ack_timer), ns_to_ktime(ack_ns), HRTIMER_MODE_REL_HARD);
+	
+	if(t_irq) {
+		latency = ktime_to_ns(ktime_sub(ktime_get(), t_irq));
+		// clamped first: a 64 bit division is not available to modules on 32 bit ARM
+		if(latency < (s64)ACK_BINS * ACK_BIN_NS) ddata->ack_hist[(u32)latency / ACK_BIN_NS]++;
+		else ddata->ack_hist[ACK_BINS - 1]++;
+	}
+	trace_silpi_ack(ddata->minor, core->val, latency);
+	return;
+}
+
+// waking up readers (the timeout starts with the first event of a batch)
+static void hw_stored(struct silcore *core, uint32_t count) {
+	struct driver_data *ddata = container_of(core, struct driver_data, core);
+	
+	trace_silpi_fill(ddata->minor, core->seq - 1, core->lt1, core->lt2, core->val, core->emask, count);
+	if(count >= ddata->wm_events) wake_up_interruptible(&(ddata->wq));
+	else if(count == 1 && ddata->wm_timeout) {
+		ddata->wm_expired = 0;
+		hrtimer_start(&(ddata->wm_timer), ddata->wm_timeout, HRTIMER_MODE_REL);
+	}
+	return;
+}
+
+static void hw_hanged(struct silcore *core) {
+	struct driver_data *ddata = container_of(core, struct driver_data, core);
 	
-	udelay(1);
+	ddata->stall_start = ktime_get();
+	WRITE_ONCE(core->ring->hanged, 1);
+	wake_up_interruptible(&(ddata->wq));
+	return;
+}
+
+static uint64_t hw_clock_raw(void) {
+	return ktime_get_raw_ns();
+}
+
+static uint64_t hw_clock_real(void) {
+	return ktime_get_real_ns();
+}
+
+enum hrtimer_restart ack_end(struct hrtimer *timer) {
+	struct driver_data *ddata = container_of(timer, struct driver_data, ack_timer);
 	
 	// end of acknowledgement signal
-	gpio_set_value(ACK, 0);
+	gpio_set_value(PIN(ddata, ACK), 0);
+	return HRTIMER_NORESTART;
+}
+
+// readers are woken up only for useful batches
+int data_ready(struct driver_data *ddata) {
+	uint32_t count = ring_count(&(ddata->core));
+	return count >= ddata->wm_events || (count && ddata->wm_expired);
+}
+
+// starting timeout for events left in the ring by the previous read
+void arm_watermark(struct driver_data *ddata) {
+	if(ddata->wm_timeout == 0 || ddata->wm_expired || ring_count(&(ddata->core)) == 0) return;
+	if(hrtimer_is_queued(&(ddata->wm_timer)) == 0) hrtimer_start(&(ddata->wm_timer), ddata->wm_timeout, HRTIMER_MODE_REL);
 	return;
 }
 
-void fill_event(struct driver_data *ddata) {
-	int write_idx = atomic_read(&(ddata->a_write_idx));
-	
-	// filling data event structure
-	ddata->events[write_idx].ts     = ktime_to_ns(ddata->lt1);
-	ddata->events[write_idx].dt     = (uint32_t)(ktime_to_ns(ddata->lt2) - ktime_to_ns(ddata->lt1));
-	ddata->events[write_idx].val    = ddata->val;
-	ddata->events[write_idx].emask  = ddata->emask;
+enum hrtimer_restart wm_expire(struct hrtimer *timer) {
+	struct driver_data *ddata = container_of(timer, struct driver_data, wm_timer);
 	
-	// setting new write index
-	write_idx = (write_idx+1) % SIZE;
-	atomic_set(&(ddata->a_write_idx), write_idx);
+	ddata->wm_expired = 1;
+	wake_up_interruptible(&(ddata->wq));
+	return HRTIMER_NORESTART;
+}
+
+// reading the event left pending by irq_rdy when the ring was full
+void recover_event(struct driver_data *ddata) {
+	if(READ_ONCE(ddata->core.ring->hanged) == 0) return;
+	WRITE_ONCE(ddata->core.ring->hanged, 0);
+	ddata->stall_ns += ktime_to_ns(ktime_sub(ktime_get(), ddata->stall_start));
 	
+	if(gpio_get_value(PIN(ddata, RDY)) == 0) {
+		FATAL("Recovering hanged buffer...\n");
+		core_pending(&(ddata->core));
+	}
 	return;
 }
 
 irqreturn_t irq_lve(int irq, void *arg) {
 	// getting IRQ timestamp as soon as possible
-	ktime_t ts = ktime_get_real();
+	uint64_t ts = ktime_get_raw_ns();
 	// retrieving data structure
 	struct driver_data *ddata = arg;
-	//checking IRQ coherence and glitches
-	int gpio_lve = gpio_get_value(LVE);
-	if(gpio_lve == ddata->old_lve) {
-		DEBUG("LVE transition glitch detected (state = %s, LVE: %d -> %d)\n", ddata->state == SILPI_IDLE ? "IDLE" : "DEAD", ddata->old_lve, gpio_lve);
-		return IRQ_HANDLED;
-	}
-	ddata->old_lve = gpio_lve;
-	
-	switch(ddata->state) {
-		case SILPI_IDLE:
-			if(gpio_lve) {
-				FATAL("Bad LVE transition detected (state = IDLE, LVE: 0 -> 1)\n");
-				if(gpio_lve) ddata->emask = SILPI_EIDLE_LVE;
-			}
-			else {
-				ddata->emask = 0;
-				ddata->val   = 65535;
-				ddata->lt1   = ts;
-				ddata->state = SILPI_DEAD;
-			}
-			break;
-		case SILPI_DEAD:
-			if(gpio_lve) {
-				ddata->lt2   = ts;
-				ddata->state = SILPI_IDLE;
-				fill_event(ddata);
-			}
-			else {
-				FATAL("Bad LVE transition detected (state = DEAD, LVE: 1 -> 0)\n");
-				ddata->emask |= SILPI_EDEAD_LVE;
-			}
-	}
-	//IRQ handling in threaded mode
+	int gpio_lve = gpio_get_value(PIN(ddata, LVE));
+	
+	trace_silpi_lve(ddata->minor, ts, gpio_lve, ddata->core.state);
+	core_lve(&(ddata->core), ts, gpio_lve);
 	return IRQ_HANDLED;
 }
 
-//threaded IRQ function
 irqreturn_t irq_rdy(int irq, void *arg) {
+	// entry time for the RDY to ACK latency
+	ktime_t t_irq = ktime_get();
 	// retrieving data structure
 	struct driver_data *ddata = arg;
-	//checking IRQ coherence and glitches
-	int gpio_rdy = gpio_get_value(RDY);
-	if(gpio_rdy) {
-		DEBUG("RDY transition glitch detected (state = %s, RDY = 1)\n", ddata->state == SILPI_IDLE ? "IDLE" : "DEAD");
-		return IRQ_HANDLED;
-	}
-	
-	if(ddata->state == SILPI_IDLE) {
-		FATAL("Bad RDY transition detected (state = IDLE, RDY: ? -> %d)\n", gpio_rdy);
-		ddata->emask = SILPI_EIDLE_NOTIME | SILPI_EIDLE_RDYIRQ;
-		ddata->lt1   = ktime_get_real();
-		ddata->state = SILPI_DEAD;
-	}
-	
-	if((atomic_read(&(ddata->a_write_idx)) + 1)%SIZE == atomic_read(&(ddata->a_read_idx))) {
-		DEBUG("buffer hanged\n");
-	}
-	else {
-		read_event(ddata);
-		send_ack(ddata);
-	}
+	int gpio_rdy = gpio_get_value(PIN(ddata, RDY));
 	
+	trace_silpi_rdy(ddata->minor, t_irq, gpio_rdy, ddata->core.state, ddata->core.write_idx, READ_ONCE(ddata->core.ring->read_idx), ddata->core.size);
+	core_rdy(&(ddata->core), t_irq, gpio_rdy);
 	return IRQ_HANDLED;
 }
 
@@ -211,53 +316,60 @@ irqreturn_t irq_rdy(int irq, void *arg) {
 int open(struct inode *inode, struct file *filp) {
 	int status;
 	int minor = MINOR(inode->i_rdev);
-	static struct driver_data ddata;
+	struct driver_data *ddata;
 	
 	DEBUG("open device %p -> %d:%d  mode %x  flags %o  by %p\n", inode->i_cdev, MAJOR(inode->i_rdev), minor, filp->f_mode, filp->f_flags, filp->f_op->owner);
 	
-	// allocate gpio's - another process request fails here
+	if(minor - BASE_MINOR >= ndev) return -ENODEV;
+	ddata = &sildev[minor - BASE_MINOR];
+	
+	// one reader for each ADC - another process request fails here
+	if(atomic_cmpxchg(&(ddata->busy), 0, 1)) return -EBUSY;
 	
-	status = gpio_request_array(gpios, ARRAY_SIZE(gpios));
+	// allocate gpio's
+	status = gpio_request_array(ddata->gpios, NGPIO);
 	if (status) {
 		printk(KERN_ALERT"%s:%s - Unable to obtain gpios.\n", HERE);
+		atomic_set(&(ddata->busy), 0);
 		return status;
 	}
 	
 	//ADC enabled but stopped
-	gpio_set_value(RUN,0);
-	gpio_set_value(ENB,1);
+	gpio_set_value(PIN(ddata, RUN),0);
+	gpio_set_value(PIN(ddata, ENB),1);
 	
 	/* create data structures for events on this pin */
-	filp->private_data = &ddata;
-	atomic_set (&ddata.a_write_idx, 0);
-	atomic_set (&ddata.a_read_idx, 0);
-	
-	gpio_direction_input(RDY);
-	ddata.rdy_irq = gpio_to_irq(RDY);
-	
-	gpio_direction_input(LVE);
-	ddata.lve_irq = gpio_to_irq(LVE);
-	
-	ddata.state  = SILPI_DEAD;
-	ddata.emask = 0;
-	
-	ddata.old_lve = 0;
-	
-	// everything is ready - register interrupt routines
-	if(request_threaded_irq(ddata.rdy_irq, irq_rdy, NULL, IRQF_TRIGGER_FALLING, "silenardy", &ddata)) {
-		printk(KERN_ALERT"%s:%s - gpib: can't register IRQ %d\n", HERE, ddata.rdy_irq);
-		gpio_free_array(gpios, ARRAY_SIZE(gpios));
+	filp->private_data = ddata;
+	core_reset(&(ddata->core));
+	ddata->wm_events       = 1;
+	ddata->wm_timeout      = 0;
+	ddata->wm_expired      = 0;
+	ddata->stall_ns        = 0;
+	memset(ddata->ack_hist, 0, sizeof(ddata->ack_hist));
+	
+	gpio_direction_input(PIN(ddata, RDY));
+	ddata->rdy_irq = gpio_to_irq(PIN(ddata, RDY));
+	
+	gpio_direction_input(PIN(ddata, LVE));
+	ddata->lve_irq = gpio_to_irq(PIN(ddata, LVE));
+	
+	// everything is ready - register interrupt routines (both run in hard IRQ context)
+	if(request_irq(ddata->rdy_irq, irq_rdy, IRQF_TRIGGER_FALLING, "silenardy", ddata)) {
+		printk(KERN_ALERT"%s:%s - gpib: can't register IRQ %d\n", HERE, ddata->rdy_irq);
+		gpio_free_array(ddata->gpios, NGPIO);
+		atomic_set(&(ddata->busy), 0);
 		return -1;
 	}
-	DEBUG("IRQ %d registered.\n", ddata.rdy_irq);
+	DEBUG("IRQ %d registered.\n", ddata->rdy_irq);
 	
-	if(request_threaded_irq(ddata.lve_irq, irq_lve, NULL, IRQF_TRIGGER_FALLING|IRQF_TRIGGER_RISING, "silenalve", &ddata)) {
-		printk(KERN_ALERT "%s:%s - gpib: can't register IRQ %d\n", HERE, ddata.lve_irq);
-		free_irq(ddata.rdy_irq, &ddata);  // unregister interrupt routine
-		gpio_free_array(gpios, ARRAY_SIZE(gpios));
+	if(request_irq(ddata->lve_irq, irq_lve, IRQF_TRIGGER_FALLING|IRQF_TRIGGER_RISING, "silenalve", ddata)) {
+		printk(KERN_ALERT "%s:%s - gpib: can't register IRQ %d\n", HERE, ddata->lve_irq);
+		free_irq(ddata->rdy_irq, ddata);  // unregister interrupt routine
+		gpio_free_array(ddata->gpios, NGPIO);
+		atomic_set(&(ddata->busy), 0);
 		return -1;
 	}
-	DEBUG("IRQ %d registered.\n", ddata.lve_irq);
+	DEBUG("IRQ %d registered.\n", ddata->lve_irq);
 	
 	return 0;
 }
@@ -267,47 +379,69 @@ int release(struct inode *inode, struct file *filp) {
 	struct driver_data *ddata = filp->private_data;
 	
 	// stop acquisition
-	gpio_set_value(RUN,0);
-	gpio_set_value(ENB,0);
+	gpio_set_value(PIN(ddata, RUN),0);
+	gpio_set_value(PIN(ddata, ENB),0);
 	
 	free_irq(ddata->rdy_irq, ddata);  // unregister interrupt routine
 	free_irq(ddata->lve_irq, ddata);  // unregister interrupt routine
-	gpio_free_array(gpios, ARRAY_SIZE(gpios));
+	hrtimer_cancel(&(ddata->wm_timer));
+	hrtimer_cancel(&(ddata->ack_timer));
+	gpio_set_value(PIN(ddata, ACK),0);
+	gpio_free_array(ddata->gpios, NGPIO);
 	
 	DEBUG("IRQ %d and %d released. GPIO released\n",ddata->rdy_irq, ddata->lve_irq);
+	atomic_set(&(ddata->busy), 0);
 	return 0;
 }
 
-// non-blocking read
+// read - it blocks until the watermark is reached, unless the device is opened with O_NONBLOCK
 ssize_t read(struct file *filp, char *buf, const size_t count, loff_t *ppos) {
-	int read_idx, write_idx;
+	u32 read_idx, write_idx;
 	int retval, transfer, request, transfer_byte;
 	int first_group, second_group;
 	struct driver_data *ddata = filp->private_data;
-	struct Silevent *events = ddata->events;
+	struct Silevent *events = ddata->core.events;
 	
 	DEBUG("requested %lu bytes.\n", (unsigned long)count);
 	
-	read_idx  = atomic_read(&(ddata->a_read_idx));
-	write_idx = atomic_read(&(ddata->a_write_idx));
+	// spectrum mode: a snapshot of the accumulated spectrum is returned
+	if(ddata->core.mode == SILPI_MODE_SPECTRUM) {
+		transfer_byte = min_t(size_t, count, sizeof(struct Silspectrum));
+		if(copy_to_user (buf, ddata->core.spec, transfer_byte)) return -EFAULT;
+		return transfer_byte;
+	}
+	
+	if((filp->f_flags & O_NONBLOCK) == 0 && count >= EVENTSIZE) {
+		arm_watermark(ddata);
+		if(wait_event_interruptible(ddata->wq, data_ready(ddata))) return -ERESTARTSYS;
+	}
+	
+	// read_idx may have been moved by a user space consumer through mmap, ring->write_idx may have been
+	// overwritten there too: the transfer is sized on the private copy (the events are visible before it)
+	read_idx  = READ_ONCE(ddata->core.ring->read_idx);
+	write_idx = smp_load_acquire(&(ddata->core.write_idx));
+	if(read_idx >= ddata->core.size) return -EINVAL;
 	
 	// no data to transfer
-	if(read_idx == write_idx) return 0;
-	if(count < EVENTSIZE) return 0;
+	if(read_idx == write_idx || count < EVENTSIZE) {
+		recover_event(ddata);
+		return 0;
+	}
 	
 	// computing amount of data to be moved to user space
-	transfer = (write_idx + SIZE - read_idx) % SIZE;
+	transfer = (write_idx + ddata->core.size - read_idx) % ddata->core.size;
 	request  = count / EVENTSIZE;
+	trace_silpi_read(ddata->minor, transfer, request, min(transfer, request));
 	if(transfer > request) transfer = request;
 	
 	// transferring data to user space
 	transfer_byte = transfer * EVENTSIZE;
-	if(read_idx + transfer <= SIZE) {
+	if(read_idx + transfer <= ddata->core.size) {
 		retval = copy_to_user (buf, events + read_idx, transfer_byte);
 		if(retval) goto copy_error;
 	}
 	else {
-		first_group = (SIZE - read_idx) * EVENTSIZE;
+		first_group = (ddata->core.size - read_idx) * EVENTSIZE;
 		retval = copy_to_user (buf, events + read_idx, first_group);
 		if(retval) goto copy_error;
 		
@@ -316,21 +450,13 @@ ssize_t read(struct file *filp, char *buf, const size_t count, loff_t *ppos) {
 		if(retval) goto copy_error;
 	}
 	
-	// updating read_idx
-	read_idx = (read_idx + transfer) % SIZE;
-	atomic_set (&(ddata->a_read_idx), read_idx);
+	// updating read_idx (slots are released only after copy)
+	read_idx = (read_idx + transfer) % ddata->core.size;
+	smp_store_release(&(ddata->core.ring->read_idx), read_idx);
+	if(read_idx == write_idx) ddata->wm_expired = 0;
 	
 	// if the buffer hanged, try to read now that buffer is empty
-	if(gpio_get_value(RDY) == 0) {
-		FATAL("Recovering hanged buffer...\n");
-		read_event(ddata);
-		send_ack(ddata);
-		if(ddata->state == SILPI_IDLE) {
-			ddata->state = SILPI_DEAD;
-			ddata->emask = SILPI_EIDLE_NOTIME;
-			ddata->lt1   = ktime_get_real();
-		}
-	}
+	recover_event(ddata);
 	return transfer_byte;
 	
 	copy_error:
@@ -340,41 +466,213 @@ ssize_t read(struct file *filp, char *buf, const size_t count, loff_t *ppos) {
 
 // write
 ssize_t write(struct file *filp, const char *user_buf, size_t count, loff_t *ppos) {
+	struct driver_data *ddata = filp->private_data;
+	
 	DEBUG("write request for %d bytes\n", (int) count);
 	
-	if(count>0 && user_buf[0]=='1') gpio_set_value(RUN,1);
-	if(count>0 && user_buf[0]=='0') gpio_set_value(RUN,0);
+	if(count>0 && user_buf[0]=='1') gpio_set_value(PIN(ddata, RUN),1);
+	if(count>0 && user_buf[0]=='0') gpio_set_value(PIN(ddata, RUN),0);
 	
 	return count;
 }
 
+// mmap - ring header and events are shared with user space
+// the consumer moves read_idx by itself and calls SILPI_IOC_RECOVER only when ring->hanged is set
+// the spectrum (read only) is mapped at offset SILPI_SPEC_OFFSET
+int mmap(struct file *filp, struct vm_area_struct *vma) {
+	struct driver_data *ddata = filp->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	
+	DEBUG("mapping %lu bytes (offset %lu pages)\n", len, vma->vm_pgoff);
+	if(vma->vm_pgoff == (SILPI_SPEC_OFFSET >> PAGE_SHIFT)) {
+		if(len > ddata->spec_bytes || (vma->vm_flags & VM_WRITE)) return -EINVAL;
+		// no mprotect(PROT_WRITE) later on
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+		return remap_vmalloc_range(vma, ddata->core.spec, 0);
+	}
+	if(vma->vm_pgoff || len > ddata->ring_bytes) return -EINVAL;
+	
+	return remap_vmalloc_range(vma, ddata->core.ring, 0);
+}
+
+// poll - the device is readable when the watermark is reached
+__poll_t poll(struct file *filp, poll_table *wait) {
+	struct driver_data *ddata = filp->private_data;
+	
+	poll_wait(filp, &(ddata->wq), wait);
+	if(data_ready(ddata)) return EPOLLIN | EPOLLRDNORM;
+	
+	arm_watermark(ddata);
+	return 0;
+}
+
+// ioctl
+long ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct driver_data *ddata = filp->private_data;
+	struct Silwatermark wm;
+	
+	switch(cmd) {
+		case SILPI_IOC_RECOVER:
+			recover_event(ddata);
+			return 0;
+		case SILPI_IOC_WATERMARK:
+			if(copy_from_user(&wm, (void __user *)arg, sizeof(wm))) return -EFAULT;
+			// a full ring must always wake up the reader
+			if(wm.events < 1) wm.events = 1;
+			if(wm.events > ddata->core.size - 1) wm.events = ddata->core.size - 1;
+			DEBUG("watermark set to %u events, %u us\n", wm.events, wm.timeout);
+			
+			hrtimer_cancel(&(ddata->wm_timer));
+			ddata->wm_events  = wm.events;
+			ddata->wm_timeout = ns_to_ktime((u64)(wm.timeout) * NSEC_PER_USEC);
+			ddata->wm_expired = 0;
+			wake_up_interruptible(&(ddata->wq));
+			return 0;
+		case SILPI_IOC_MODE:
+			if(arg != SILPI_MODE_EVENTS && arg != SILPI_MODE_SPECTRUM) return -EINVAL;
+			DEBUG("acquisition mode set to %s\n", arg == SILPI_MODE_SPECTRUM ? "spectrum" : "events");
+			WRITE_ONCE(ddata->core.mode, (int)arg);
+			return 0;
+		case SILPI_IOC_CLEAR:
+			// refused with the ADC gate open, an event still in flight (LVE handler) ends before or after the clear
+			if(gpio_get_value(PIN(ddata, RUN))) return -EBUSY;
+			disable_irq(ddata->lve_irq);
+			memset(ddata->core.spec, 0, sizeof(struct Silspectrum));
+			enable_irq(ddata->lve_irq);
+			return 0;
+	}
+	return -ENOTTY;
+}
+
+// sysfs attributes - counters are in /sys/class/SilPi/silena*/
+#define SILPI_COUNTER(name, field) \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) { \
+	struct driver_data *ddata = dev_get_drvdata(dev); \
+	return sysfs_emit(buf, "%llu\n", (unsigned long long)READ_ONCE(ddata->field)); \
+} \
+static DEVICE_ATTR_RO(name)
+
+SILPI_COUNTER(size, core.size);
+SILPI_COUNTER(stalls, core.stalls);
+SILPI_COUNTER(stall_ns, stall_ns);
+SILPI_COUNTER(lve_glitches, core.lve_glitches);
+SILPI_COUNTER(rdy_glitches, core.rdy_glitches);
+SILPI_COUNTER(bad_lve, core.bad_lve);
+SILPI_COUNTER(bad_rdy, core.bad_rdy);
+
+static struct attribute *silpi_attrs[] = {
+	&dev_attr_size.attr,
+	&dev_attr_stalls.attr,
+	&dev_attr_stall_ns.attr,
+	&dev_attr_lve_glitches.attr,
+	&dev_attr_rdy_glitches.attr,
+	&dev_attr_bad_lve.attr,
+	&dev_attr_bad_rdy.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(silpi);
+
+// debugfs - RDY to ACK latency histogram in /sys/kernel/debug/SilPi/silena*/ack_latency
+static int ack_latency_show(struct seq_file *m, void *v) {
+	struct driver_data *ddata = m->private;
+	int j;
+	
+	seq_printf(m, "# RDY handler entry to ACK latency (reset at open)\n");
+	seq_printf(m, "# from(ns)      count\n");
+	for(j=0; j<ACK_BINS; j++) seq_printf(m, "%10d %10u\n", j * ACK_BIN_NS, READ_ONCE(ddata->ack_hist[j]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ack_latency);
+
 //struct fops
 static struct file_operations fops= {
-	.owner   = THIS_MODULE,
-	.open    = open,
-	.release = release,
-	.read    = read,
-	.write   = write,
+	.owner          = THIS_MODULE,
+	.open           = open,
+	.release        = release,
+	.read           = read,
+	.write          = write,
+	.mmap           = mmap,
+	.poll           = poll,
+	.unlocked_ioctl = ioctl,
 };
 
+// instance setup: GPIO mapping, event ring and timers
+int setup_instance(struct driver_data *ddata, int minor) {
+	BUILD_BUG_ON(sizeof(struct Silanchor) != EVENTSIZE);
+	
+	ddata->minor = minor;
+	memcpy(ddata->gpios, default_gpios, sizeof(default_gpios));
+	if(gpiomap[minor] && parse_gpiomap(ddata, gpiomap[minor])) {
+		FATAL("bad gpiomap for ADC %d (18 comma separated GPIO numbers expected)\n", minor);
+		return -EINVAL;
+	}
+	
+	// allocate the event ring: one header page followed by the events (zeroed and mappable)
+	ddata->core.size  = ring_size;
+	ddata->ring_bytes = PAGE_SIZE + PAGE_ALIGN((unsigned long)ring_size * EVENTSIZE);
+	ddata->core.ring  = vmalloc_user(ddata->ring_bytes);
+	if(ddata->core.ring == NULL) {
+		FATAL("can't allocate event ring (%lu bytes)\n", ddata->ring_bytes);
+		return -ENOMEM;
+	}
+	ddata->core.events       = (struct Silevent *)((char *)ddata->core.ring + PAGE_SIZE);
+	ddata->core.ring->size   = ddata->core.size;
+	ddata->core.ring->offset = PAGE_SIZE;
+	ddata->wm_events         = 1;
+	
+	ddata->spec_bytes = PAGE_ALIGN(sizeof(struct Silspectrum));
+	ddata->core.spec  = vmalloc_user(ddata->spec_bytes);
+	if(ddata->core.spec == NULL) {
+		FATAL("can't allocate spectrum (%lu bytes)\n", ddata->spec_bytes);
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&(ddata->wq));
+	hrtimer_init(&(ddata->wm_timer), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ddata->wm_timer.function = wm_expire;
+	hrtimer_init(&(ddata->ack_timer), CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	ddata->ack_timer.function = ack_end;
+	
+	if(gpio_base && setup_fastread(ddata)) FATAL("falling back to single pin reading for ADC %d\n", minor);
+	return 0;
+}
+
 //      exit - cleanup and module removal
 static void mod_exit(void) {
-	int major;
+	int major, i;
+	struct driver_data *ddata;
 	
 	major = MAJOR(device);
-	if(dev_device) device_destroy (dev_class,MKDEV(major, BASE_MINOR));
+	for(i=0; i<ndev; i++) {
+		ddata = &sildev[i];
+		if(ddata->dev) device_destroy (dev_class,MKDEV(major, BASE_MINOR + i));
+	}
+	debugfs_remove_recursive(dbg_dir);
 	if(dev_class) class_destroy (dev_class);
 	if(cdev_flag) cdev_del (&cdev);
-	if(device) unregister_chrdev_region(device, 1);
+	if(device) unregister_chrdev_region(device, ndev);
+	for(i=0; i<ndev; i++) {
+		ddata = &sildev[i];
+		if(ddata->core.ring) vfree(ddata->core.ring);
+		if(ddata->core.spec) vfree(ddata->core.spec);
+		if(ddata->gplev) iounmap(ddata->gplev);
+	}
 }
 
 // init - module initialization
 static int mod_init(void) {
 	long status=0;
-	int major;
+	int major, i;
+	struct driver_data *ddata;
+	
+	// one ADC with the default mapping if gpiomap is not given
+	if(ndev == 0) ndev = 1;
 	
 	// obtain major device number or exit
-	status = alloc_chrdev_region(&device, BASE_MINOR, 1, NAME);
+	status = alloc_chrdev_region(&device, BASE_MINOR, ndev, NAME);
 	if(status < 0) {
 		FATAL("can't get major\n");
 		return status;
@@ -382,11 +680,21 @@ static int mod_init(void) {
 	major = MAJOR(device);
 	DEBUG("major is %d\n", major);
 	
-	// create and register the device
+	if(ring_size < 2 || ring_size > RING_MAX) {
+		FATAL("bad ring size %u (2-%u allowed)\n", ring_size, RING_MAX);
+		status = -EINVAL;
+		goto failure;
+	}
+	for(i=0; i<ndev; i++) {
+		status = setup_instance(&sildev[i], i);
+		if(status) goto failure;
+	}
+	
+	// create and register the devices
 	cdev_init(&cdev, &fops);
 	cdev.owner = THIS_MODULE;
 	
-	status = cdev_add (&cdev, device, 1);
+	status = cdev_add (&cdev, device, ndev);
 	if(status) {
 		FATAL("can't register device %d (status = %ld)\n", device, status);
 		goto failure;
@@ -394,7 +702,7 @@ static int mod_init(void) {
 	cdev_flag = 1;
 	DEBUG("registered device: %d %p %p\n", device, &fops, &cdev);
 	
-	// create the /dev/silena node
+	// create the /dev/silena, /dev/silena1, ... nodes
 	dev_class = class_create(THIS_MODULE, NAME);
 	if(IS_ERR(dev_class)) {
 		status = (long)dev_class;
@@ -403,15 +711,21 @@ static int mod_init(void) {
 		goto failure;
 	}
 	
-	dev_device = device_create(dev_class, NULL, MKDEV(major, BASE_MINOR), NULL, "silena");
-	
-	DEBUG("created device %p\n", dev_device);
-	
-	if(IS_ERR(dev_device)) {
-		FATAL("device_create failed\n");
-		status = (long)dev_device;
-		dev_device = NULL;
-		goto failure;
+	dbg_dir = debugfs_create_dir(NAME, NULL);
+	for(i=0; i<ndev; i++) {
+		ddata = &sildev[i];
+		if(i) ddata->dev = device_create_with_groups(dev_class, NULL, MKDEV(major, BASE_MINOR + i), ddata, silpi_groups, "silena%d", i);
+		else  ddata->dev = device_create_with_groups(dev_class, NULL, MKDEV(major, BASE_MINOR), ddata, silpi_groups, "silena");
+		
+		DEBUG("created device %p\n", ddata->dev);
+		
+		if(IS_ERR(ddata->dev)) {
+			FATAL("device_create failed\n");
+			status = (long)ddata->dev;
+			ddata->dev = NULL;
+			goto failure;
+		}
+		debugfs_create_file("ack_latency", S_IRUGO, debugfs_create_dir(dev_name(ddata->dev), dbg_dir), ddata, &ack_latency_fops);
 	}
 	
 	DEBUG("installed by \"%s\" (pid %i) at %p\n", current->comm, current->pid, current);
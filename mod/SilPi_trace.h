@@ -0,0 +1,132 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilPi static tracepoints (perf / ftrace)
+// events are in /sys/kernel/tracing/events/silpi/, e.g. "perf record -e 'silpi:*'"
+// disabled tracepoints cost a patched-out branch: arguments are just loads, ring occupancy is computed here
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM silpi
+
+#if !defined(_SILPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SILPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// unread events from ring indexes
+#define SILPI_OCCUPANCY(w, r, size) ((r) <= (w) ? (w) - (r) : (w) + (size) - (r))
+
+// LVE edge (traced before the glitch check: a glitch has lve equal to the previous level)
+TRACE_EVENT(silpi_lve,
+	TP_PROTO(int minor, uint64_t ts, int lve, int state),
+	TP_ARGS(minor, ts, lve, state),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(s64, ts)
+		__field(int, lve)
+		__field(int, state)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ts    = ts;
+		__entry->lve   = lve;
+		__entry->state = state;
+	),
+	TP_printk("adc=%d ts=%lld lve=%d state=%s", __entry->minor, __entry->ts, __entry->lve, __entry->state ? "DEAD" : "IDLE")
+);
+
+// RDY falling edge, with the ring occupancy seen by the handler
+TRACE_EVENT(silpi_rdy,
+	TP_PROTO(int minor, ktime_t t_irq, int rdy, int state, uint32_t write_idx, uint32_t read_idx, uint32_t size),
+	TP_ARGS(minor, t_irq, rdy, state, write_idx, read_idx, size),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(s64, t_irq)
+		__field(int, rdy)
+		__field(int, state)
+		__field(uint32_t, count)
+		__field(uint32_t, size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->t_irq = ktime_to_ns(t_irq);
+		__entry->rdy   = rdy;
+		__entry->state = state;
+		__entry->count = SILPI_OCCUPANCY(write_idx, read_idx, size);
+		__entry->size  = size;
+	),
+	TP_printk("adc=%d t_irq=%lld rdy=%d state=%s ring=%u/%u", __entry->minor, __entry->t_irq, __entry->rdy, __entry->state ? "DEAD" : "IDLE", __entry->count, __entry->size)
+);
+
+// ACK raised, latency from the RDY handler entry (-1 = recovery of a hanged ring)
+TRACE_EVENT(silpi_ack,
+	TP_PROTO(int minor, uint16_t val, s64 latency),
+	TP_ARGS(minor, val, latency),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(uint16_t, val)
+		__field(s64, latency)
+	),
+	TP_fast_assign(
+		__entry->minor   = minor;
+		__entry->val     = val;
+		__entry->latency = latency;
+	),
+	TP_printk("adc=%d val=%u latency=%lld ns", __entry->minor, __entry->val, __entry->latency)
+);
+
+// event stored in the ring
+TRACE_EVENT(silpi_fill,
+	TP_PROTO(int minor, uint32_t seq, uint64_t lt1, uint64_t lt2, uint16_t val, uint16_t emask, uint32_t count),
+	TP_ARGS(minor, seq, lt1, lt2, val, emask, count),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(uint32_t, seq)
+		__field(s64, ts)
+		__field(s64, dt)
+		__field(uint16_t, val)
+		__field(uint16_t, emask)
+		__field(uint32_t, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->seq   = seq;
+		__entry->ts    = lt1;
+		__entry->dt    = lt2 - lt1;
+		__entry->val   = val;
+		__entry->emask = emask;
+		__entry->count = count;
+	),
+	TP_printk("adc=%d seq=%u ts=%lld dt=%lld val=%u emask=0x%x ring=%u", __entry->minor, __entry->seq, __entry->ts, __entry->dt, __entry->val, __entry->emask, __entry->count)
+);
+
+// read() transfer: occupancy before the copy and events moved to user space
+TRACE_EVENT(silpi_read,
+	TP_PROTO(int minor, uint32_t count, uint32_t request, uint32_t transfer),
+	TP_ARGS(minor, count, request, transfer),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(uint32_t, count)
+		__field(uint32_t, request)
+		__field(uint32_t, transfer)
+	),
+	TP_fast_assign(
+		__entry->minor    = minor;
+		__entry->count    = count;
+		__entry->request  = request;
+		__entry->transfer = transfer;
+	),
+	TP_printk("adc=%d ring=%u request=%u transfer=%u", __entry->minor, __entry->count, __entry->request, __entry->transfer)
+);
+
+#endif /* _SILPI_TRACE_H */
+
+// the header is not in include/trace/events: define_trace.h looks for it in this directory
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE SilPi_trace
+#include <trace/define_trace.h>
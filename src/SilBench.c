@@ -0,0 +1,314 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilPi driver core - user space harness and benchmark
+// The acquisition FSM and the event ring of the kernel module (mod/SilCore.h) run here
+// on simulated GPIO lines. Every event is replayed as LVE fall, RDY fall, LVE rise; a
+// consumer drains the ring and checks sequence numbers, values and realtime anchors.
+// The packed wire encoding (src/SilCodec.c) is checked first, on random batches.
+// The exit status is non-zero if any check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "../include/ShellColors.h"
+
+static int verbose = 0;
+#define FATAL(frm,...) if(verbose) printf(YEL "   core" NRM ": " frm, ##__VA_ARGS__)
+#define DEBUG(frm,...) if(verbose > 1) printf(BLD "   core" NRM ": " frm, ##__VA_ARGS__)
+
+#include "../mod/SilCore.h"
+#include "../include/SilCodec.h"
+
+#define REALTIME_OFFSET 1600000000000000000ULL // simulated CLOCK_REALTIME - CLOCK_MONOTONIC_RAW
+#define LIVE_NS 2000  // simulated time between events...
+#define CONV_NS 3000  // ...conversion time (LVE fall to RDY fall)...
+#define ACK_NS  500   // ...and reading time (RDY fall to LVE rise)
+#define MAXERR  10    // errors printed in detail
+#define CODEC_N 20000 // records in the codec check batch...
+#define CODEC_T 300   // ...and in the one decoded at every truncated length
+
+// default GPIO mapping of the data lines (D00-D12)
+static const int data_pins[NDATA] = {4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 16, 18, 19};
+
+// simulated hardware
+struct simhw {
+	uint64_t now;       // CLOCK_MONOTONIC_RAW, moved forward by the edge sequence
+	uint32_t lev;       // level register
+	uint32_t lev_of[8192]; // level register for each ADC value
+	uint64_t acks, hangs;
+	uint32_t maxcount;  // maximum ring occupancy
+};
+static struct simhw sim;
+
+static uint16_t hw_data(struct silcore *core) {
+	return core_levels(core, sim.lev);
+}
+
+static void hw_ack(struct silcore *core, int64_t t_irq) {
+	(void)core; (void)t_irq;
+	sim.acks++;
+}
+
+static void hw_stored(struct silcore *core, uint32_t count) {
+	(void)core;
+	if(count > sim.maxcount) sim.maxcount = count;
+}
+
+static void hw_hanged(struct silcore *core) {
+	sim.hangs++;
+	WRITE_ONCE(core->ring->hanged, 1);
+}
+
+static uint64_t hw_clock_raw(void) {
+	return sim.now;
+}
+
+static uint64_t hw_clock_real(void) {
+	return sim.now + REALTIME_OFFSET;
+}
+
+// ADC values (2-8191), the consumer replays the same sequence
+static uint16_t next_value(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return (uint16_t)(2 + *state % 8190);
+}
+
+struct consumer {
+	uint32_t rng, seq;
+	uint64_t events, anchors, errors;
+};
+
+static void error(struct consumer *c, const char *what, const uint32_t seq) {
+	if(c->errors++ < MAXERR) printf(RED "  check" NRM ": %s (seq = %u)\n", what, seq);
+}
+
+// reads every record in the ring, like a mmap consumer (see dev_read)
+static void drain(struct silcore *core, struct consumer *c) {
+	struct Silring *ring = core->ring;
+	struct Silevent *ev;
+	struct Silanchor *anchor;
+	uint32_t r = ring->read_idx, w = smp_load_acquire(&(ring->write_idx));
+	
+	for(; r != w; r = (r + 1 == ring->size) ? 0 : r + 1) {
+		ev = &(core->events[r]);
+		if(ev->seq != c->seq) error(c, "sequence gap", ev->seq);
+		c->seq = ev->seq + 1;
+		if(ev->ver != SILPI_REC_VERSION) error(c, "bad record version", ev->seq);
+		
+		if(ev->type == SILPI_REC_ANCHOR) {
+			anchor = (struct Silanchor *)ev;
+			if(anchor->rt - anchor->ts != REALTIME_OFFSET) error(c, "bad realtime anchor", ev->seq);
+			c->anchors++;
+			continue;
+		}
+		//the first event closes the dead time open at reset
+		if(c->events++ == 0) continue;
+		if(ev->val != next_value(&(c->rng))) error(c, "wrong ADC value", ev->seq);
+		if(ev->emask) error(c, "unexpected error mask", ev->seq);
+		if(ev->dt != CONV_NS + ACK_NS) error(c, "wrong dead time", ev->seq);
+	}
+	smp_store_release(&(ring->read_idx), r);
+	
+	// same as recover_event: RDY is still low while the ring is hanged
+	if(READ_ONCE(ring->hanged)) {
+		WRITE_ONCE(ring->hanged, 0);
+		core_pending(core);
+	}
+}
+
+static uint32_t xorshift(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+// random batch like the ones read from the device: mostly consecutive events, with anchors,
+// sequence gaps (backwards too), error masks, out of range values and unknown record types
+static void codec_batch(struct Silevent *ev, const uint32_t n, uint32_t *rng) {
+	struct Silanchor *anchor;
+	uint64_t ts = 1000000000ULL;
+	uint32_t i, seq = 1, r;
+	
+	memset(ev, 0, n * sizeof(struct Silevent));
+	for(i=0; i<n; i++) {
+		r = xorshift(rng) % 1000;
+		ev[i].ver = SILPI_REC_VERSION;
+		ev[i].type = SILPI_REC_EVENT;
+		if(r < 5) seq += xorshift(rng) % 100;      // lost records
+		if(r == 5) seq -= xorshift(rng) % 10;      // replayed ones
+		ev[i].seq = seq++;
+		if(r >= 10 && r < 20) {
+			// anchors are sampled after the conversion start of the next event: ts goes back
+			anchor = (struct Silanchor *)(ev + i);
+			anchor->type = SILPI_REC_ANCHOR;
+			anchor->ts = ts + xorshift(rng) % 1000;
+			anchor->rt = anchor->ts + REALTIME_OFFSET + xorshift(rng) % 1000;
+			continue;
+		}
+		ts += LIVE_NS + xorshift(rng) % 100000;
+		ev[i].ts = ts;
+		ev[i].dt = CONV_NS + ACK_NS + xorshift(rng) % 1000;
+		ev[i].val = (uint16_t)(xorshift(rng) % 8192);
+		if(r >= 20 && r < 25) ev[i].emask = (uint16_t)(1 + xorshift(rng) % 0xffff);
+		if(r == 25) ev[i].val = (uint16_t)(8192 + xorshift(rng) % 50000); // stored as a raw record
+		if(r == 26) ev[i].ver = SILPI_REC_VERSION + 1;
+		if(r == 27) ev[i].type = 7;
+	}
+}
+
+// records encoded and decoded back must be identical, truncated or oversized frames rejected
+static int codec_check(void) {
+	struct Silevent *ev = calloc(CODEC_N, sizeof(struct Silevent)), *out = calloc(CODEC_N, sizeof(struct Silevent));
+	uint8_t *frame = malloc(SILPI_CODEC_BOUND(CODEC_N));
+	size_t size, len;
+	uint32_t rng = 88675123U;
+	int errors = 0;
+	
+	if(ev == NULL || out == NULL || frame == NULL) {
+		perror(RED "  codec" NRM);
+		exit(EXIT_FAILURE);
+	}
+	codec_batch(ev, CODEC_N, &rng);
+	size = codec_encode(ev, CODEC_N, frame);
+	if(size > SILPI_CODEC_BOUND(CODEC_N)) errors++;
+	if(codec_decode(frame, size, out, CODEC_N) != CODEC_N || memcmp(ev, out, CODEC_N * sizeof(struct Silevent))) errors++;
+	if(codec_decode(frame, size, out, CODEC_N - 1) != -1) errors++;
+	if(codec_encode(ev, 0, frame) != 12 || codec_decode(frame, 12, out, 0) != 0) errors++;
+	printf(BLD "  codec" NRM ": %d records, %.2f bytes/record (raw %zu)\n", CODEC_N, (double)size / CODEC_N, sizeof(struct Silevent));
+	
+	codec_batch(ev, CODEC_T, &rng);
+	size = codec_encode(ev, CODEC_T, frame);
+	for(len=0; len<size; len++) {
+		if(codec_decode(frame, len, out, CODEC_T) != -1) errors++;
+	}
+	if(codec_decode(frame, size, out, CODEC_T) != CODEC_T || memcmp(ev, out, CODEC_T * sizeof(struct Silevent))) errors++;
+	
+	if(errors) printf(RED "  codec" NRM ": FAILED (%d errors)\n", errors);
+	else printf(GRN "  codec" NRM ": round trip and truncated frames (%zu lengths) passed\n", size);
+	free(frame);
+	free(out);
+	free(ev);
+	return errors;
+}
+
+void usage(const char *name) {
+	printf("usage: %s [-n events] [-r ring size] [-d drain period] [-g glitch period] [-s] [-v]\n", name);
+	printf("    -n  number of simulated events (default 10000000)\n");
+	printf("    -r  ring capacity in events (default %d)\n", SIZE);
+	printf("    -d  the consumer drains the ring every d events (default 1000, > ring size to test full ring recovery)\n");
+	printf("    -g  one LVE and one RDY glitch every g events (default 0 = none)\n");
+	printf("    -s  spectrum mode\n");
+	printf("    -v  print core messages (twice for debug messages)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t nev = 10000000, drain_every = 1000, glitch = 0, i, j, sum = 0;
+	uint32_t size = SIZE, rng = 2463534242U;
+	int opt, spectrum = 0, failed = 0;
+	
+	while((opt = getopt(argc, argv, "n:r:d:g:sv")) != -1) {
+		switch(opt) {
+			case 'n': nev = strtoull(optarg, NULL, 10); break;
+			case 'r': size = strtoul(optarg, NULL, 10); break;
+			case 'd': drain_every = strtoull(optarg, NULL, 10); break;
+			case 'g': glitch = strtoull(optarg, NULL, 10); break;
+			case 's': spectrum = 1; break;
+			case 'v': verbose++; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(size < 2 || drain_every == 0) usage(argv[0]);
+	
+	if(codec_check()) failed++;
+	
+	struct silcore *core = calloc(1, sizeof(struct silcore));
+	core->ring   = calloc(1, sizeof(struct Silring));
+	core->events = calloc(size, sizeof(struct Silevent));
+	core->spec   = calloc(1, sizeof(struct Silspectrum));
+	if(core->ring == NULL || core->events == NULL || core->spec == NULL) {
+		perror(RED "  bench" NRM);
+		exit(EXIT_FAILURE);
+	}
+	core->size = size;
+	core->ring->size = size;
+	if(core_setup_lut(core, data_pins)) exit(EXIT_FAILURE);
+	core_reset(core);
+	if(spectrum) core->mode = SILPI_MODE_SPECTRUM;
+	
+	// data lines are active low
+	for(i=0; i<8192; i++) {
+		for(j=0; j<NDATA; j++) {
+			if(((i ^ 0x1fff) >> j) & 1) sim.lev_of[i] |= 1U << data_pins[j];
+		}
+	}
+	
+	struct consumer c = {rng, 0, 0, 0, 0};
+	struct timespec t0, t1;
+	uint16_t v;
+	
+	printf(BLD "  bench" NRM ": %" PRIu64 " events, ring = %u, drain every %" PRIu64 " events, %s mode\n", nev, size, drain_every, spectrum ? "spectrum" : "events");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	
+	// end of the dead time open at reset
+	sim.now = LIVE_NS;
+	core_lve(core, sim.now, 1);
+	for(i=0; i<nev; i++) {
+		v = next_value(&rng);
+		
+		sim.now += LIVE_NS;
+		core_lve(core, sim.now, 0);
+		if(glitch && i % glitch == 0) {
+			core_lve(core, sim.now, 0);
+			core_rdy(core, (int64_t)sim.now, 1);
+		}
+		
+		sim.now += CONV_NS;
+		sim.lev = sim.lev_of[v];
+		core_rdy(core, (int64_t)sim.now, 0);
+		// ADC waiting for ACK on a full ring: the consumer must make room
+		if(READ_ONCE(core->ring->hanged) && spectrum == 0) drain(core, &c);
+		
+		sim.now += ACK_NS;
+		core_lve(core, sim.now, 1);
+		if(spectrum == 0 && (i + 1) % drain_every == 0) drain(core, &c);
+	}
+	if(spectrum == 0) drain(core, &c);
+	
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double elapsed = (double)(t1.tv_sec - t0.tv_sec) + 1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+	
+	printf(BLD "  bench" NRM ": %.3f s -> %.2f Mevents/s, %.1f ns/event (edge replay and consumer included)\n", elapsed, 1e-6 * (double)nev / elapsed, 1e9 * elapsed / (double)nev);
+	printf(BLD "  bench" NRM ": acks = %" PRIu64 ", stalls = %" PRIu64 ", max occupancy = %u, anchors = %" PRIu64 "\n", sim.acks, core->stalls, sim.maxcount, c.anchors);
+	printf(BLD "  bench" NRM ": glitches LVE = %" PRIu64 ", RDY = %" PRIu64 ", bad LVE = %" PRIu64 ", bad RDY = %" PRIu64 "\n", core->lve_glitches, core->rdy_glitches, core->bad_lve, core->bad_rdy);
+	
+	// consistency checks
+	if(spectrum) {
+		for(i=0; i<SILPI_SPEC_BINS; i++) sum += core->spec->bins[i];
+		if(core->spec->events != nev + 1 || sum != nev + 1) failed++;
+	}
+	else if(c.events != nev + 1 || c.errors) failed++;
+	if(sim.acks != nev || sim.hangs != core->stalls || core->bad_lve || core->bad_rdy) failed++;
+	if(core->lve_glitches != (glitch ? (nev + glitch - 1) / glitch : 0) || core->rdy_glitches != core->lve_glitches) failed++;
+	
+	if(failed) printf(RED "  bench" NRM ": FAILED (%" PRIu64 " record errors)\n", c.errors);
+	else printf(GRN "  bench" NRM ": all checks passed\n");
+	
+	free(core->spec);
+	free(core->events);
+	free(core->ring);
+	free(core);
+	return failed ? EXIT_FAILURE : 0;
+}
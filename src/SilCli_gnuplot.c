@@ -16,6 +16,7 @@
 
 #include "../include/ShellColors.h"
 #include "../include/SilStruct.h"
+#include "../include/SilCodec.h"
 
 int go=1;
 
@@ -24,6 +25,80 @@ void sigh(int sig) {
 	return;
 }
 
+//packed frame of n bytes to events in data, returns the size of the events (0 on errors)
+int unpack(const uint8_t *packed, const int n, struct Silevent *data) {
+	int64_t count;
+	
+	if(n < 0) return 0;
+	count = codec_decode(packed, (size_t)n, data, SIZE);
+	if(count < 0) {
+		printf(UP YEL "    main" NRM ": bad packed frame (size = %d)\n\n", n);
+		return 0;
+	}
+	return (int)count * (int)sizeof(struct Silevent);
+}
+
+//REQ socket to the server with the identity of this client: a new socket takes over the cursor of the old one
+void *req_open(void *context, const char *host, const char *ident) {
+	int timeout = 1000, linger = 0;
+	void *req = zmq_socket(context, ZMQ_REQ);
+	
+	zmq_setsockopt(req, ZMQ_ROUTING_ID, ident, strlen(ident));
+	zmq_setsockopt(req, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+	zmq_setsockopt(req, ZMQ_LINGER, &linger, sizeof(linger));
+	if(zmq_connect(req, host)) {
+		perror(RED "    main" NRM);
+		exit(EXIT_FAILURE);
+	}
+	return req;
+}
+
+//request with retries: a reply lost or late (network blip) is requested again on a new socket
+//returns the size of the first reply frame (the others are waiting on *req), -1 if the server is unreachable
+int query(void *context, void **req, const char *host, const char *ident, const char *cmd, void *ans, const int size) {
+	int n, tries;
+	
+	for(tries = 0; tries < 5; tries++) {
+		if(zmq_send(*req, cmd, strlen(cmd) + 1, 0) >= 0) {
+			n = zmq_recv(*req, ans, size, 0);
+			if(n >= 0) return n;
+		}
+		//the REQ socket would wait for this reply forever
+		zmq_close(*req);
+		*req = req_open(context, host, ident);
+		if(!go) return -1;
+		printf(UP YEL "    main" NRM ": no reply to \"%s\", trying again\n\n", cmd);
+	}
+	return -1;
+}
+
+//server-side spectrum: only the bins changed since *version travel, spec and *version are updated
+//returns 0 (sd: totals) or -1 if the server did not reply
+int spec_update(void *context, void **req, const char *host, const char *ident, uint64_t *version, uint64_t *spec, struct Silspecdelta *sd) {
+	static struct Silspecbin bins[SILPI_SPEC_BINS];
+	char cmd[40];
+	int n, k;
+	
+	sprintf(cmd, "spec %" PRIu64, *version);
+	n = query(context, req, host, ident, cmd, sd, sizeof(*sd));
+	if(n != sizeof(*sd) || sd->magic != SILPI_SPEC_MAGIC) return -1;
+	n = zmq_recv(*req, bins, sizeof(bins), 0);
+	if(n < 0) return -1;
+	if(sd->full) memset(spec, 0, SILPI_SPEC_BINS * sizeof(uint64_t));
+	for(k = 0; k < n / (int)sizeof(struct Silspecbin); k++) spec[bins[k].bin] = bins[k].count;
+	*version = sd->version;
+	return 0;
+}
+
+//skips the remaining frames of a message
+void drain(void *sock) {
+	int more = 1;
+	size_t len = sizeof(more);
+	char dump[1];
+	
+	while(zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &len) == 0 && more && zmq_recv(sock, dump, 1, 0) >= 0);
+}
+
 int main(int argc, char *argv[]) {
 	char fn[1000] = "SilCli.cfg";
 	if(argc > 1) {
@@ -35,8 +110,8 @@ int main(int argc, char *argv[]) {
 	if(f == NULL) printf(YEL "    main" NRM ": config file not found. Using default values!\n");
 	
 	char buffer[1000], par[1000], pardata[900];
-	char host[1000] = "192.168.1.2", prefix[900] = "acq";
-	int bits = 13, range = 0, comment;
+	char host[1000], prefix[900] = "acq", pihost[900] = "192.168.1.2", policy[10] = "";
+	int bits = 13, range = 0, comment, stype = 0, adc = 0, sport = -1, codec = SILPI_CODEC_PACK, specmode = 0;
 	for(;f;) {
 		if(fgets(buffer, 1000, f) == NULL) break;
 		comment = 0;
@@ -50,17 +125,47 @@ int main(int argc, char *argv[]) {
 		if(comment) continue;
 		if(sscanf(buffer, "%s %[^\n]", par, pardata) < 2) continue;
 		
-		if(strcmp(par, "host") == 0) sprintf(host, "tcp://%s:4747", pardata);
+		if(strcmp(par, "host") == 0) strcpy(pihost, pardata);
+		if(strcmp(par, "adc") == 0) adc = atoi(pardata);
+		if(strcmp(par, "stream") == 0) {
+			if(strcmp(pardata, "push") == 0) stype = ZMQ_PULL;
+			if(strcmp(pardata, "pub") == 0) stype = ZMQ_SUB;
+		}
+		if(strcmp(par, "stream_port") == 0) sport = atoi(pardata);
+		if(strcmp(par, "policy") == 0 && (strcmp(pardata, "block") == 0 || strcmp(pardata, "drop") == 0)) strcpy(policy, pardata);
+		if(strcmp(par, "codec") == 0) codec = (strcmp(pardata, "raw") == 0) ? SILPI_CODEC_RAW : SILPI_CODEC_PACK;
+		if(strcmp(par, "mode") == 0) specmode = (strcmp(pardata, "spectrum") == 0);
 		if(strcmp(par, "bits") == 0) bits = atoi(pardata);
 		if(strcmp(par, "out") == 0) strcpy(prefix, pardata);
 	}
 	if(f) fclose(f);
 	
+	//the server of ADC n listens on port 4747 + n and streams on port 4847 + n (unless stream_port is given)
+	if(adc < 0) adc = 0;
+	if(sport < 0) sport = 4847 + adc;
+	snprintf(host, sizeof(host), "tcp://%s:%d", pihost, 4747 + adc);
+	
+	//the identity lets the server recognise this client when it reconnects (see query)
+	char ident[300], hostname[200];
+	gethostname(hostname, sizeof(hostname));
+	hostname[sizeof(hostname) - 1] = '\0';
+	snprintf(ident, sizeof(ident), "gnuplot@%s:%d", hostname, (int)getpid());
 	void *context   = zmq_ctx_new();
-	void *requester = zmq_socket(context, ZMQ_REQ);
-	if(zmq_connect(requester, host)) {
-		perror(RED "    main" NRM);
-		exit(EXIT_FAILURE);
+	void *requester = req_open(context, host, ident);
+	
+	//optional streaming channel (same type as the server one): data arrive without requests
+	//(not needed for the spectrum only)
+	void *streamer = NULL;
+	if(stype && specmode == 0) {
+		int timeout = 100; //returning to the main loop at least every 100 ms
+		streamer = zmq_socket(context, stype);
+		if(stype == ZMQ_SUB) zmq_setsockopt(streamer, ZMQ_SUBSCRIBE, "", 0);
+		zmq_setsockopt(streamer, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+		snprintf(buffer, sizeof(buffer), "tcp://%s:%d", pihost, sport);
+		if(zmq_connect(streamer, buffer)) {
+			perror(RED "    main" NRM);
+			exit(EXIT_FAILURE);
+		}
 	}
 	
 	do sprintf(par, "%s%05d.dat", prefix, range++);
@@ -87,22 +192,52 @@ int main(int argc, char *argv[]) {
 	printf("* version 1.0 (Simone Valdre', 2022)\n\n");
 	printf("Starting with the following parameters:\n");
 	printf(BLD "         Raspberry hostname" NRM " -> %s\n", host);
+	printf(BLD "          Silena ADC number" NRM " -> %d (port %d)\n", adc, 4747 + adc);
 	printf(BLD "    Silena ADC bits (range)" NRM " -> %d (%d)\n", bits, range);
-	printf(BLD "                Output file" NRM " -> %s\n\n", par);
+	printf(BLD "                Output file" NRM " -> %s\n", par);
+	printf(BLD "          Streaming channel" NRM " -> %s\n", streamer ? buffer : "off");
+	printf(BLD "                       Mode" NRM " -> %s\n\n", specmode ? "spectrum (accumulated by the server)" : "events");
 	
 	int n;
-	zmq_send(requester, "start", 6, 0);
-	n = zmq_recv(requester, buffer, 999, 0);
-	buffer[n] = '\0';
+	if(policy[0] && streamer == NULL && specmode == 0) {
+		//this client only: block (nothing lost, acquisition pauses if too slow) or drop
+		//(streaming clients follow the socket type instead)
+		n = query(context, &requester, host, ident, policy, buffer, 999);
+		buffer[n < 0 ? 0 : n] = '\0';
+		printf(BLD "    main" NRM ": %s policy -> %s\n", policy, buffer);
+	}
+	if(codec == SILPI_CODEC_PACK && streamer == NULL && specmode == 0) {
+		//packed replies, if the server knows them (the streaming server packs by configuration)
+		n = query(context, &requester, host, ident, "codec", buffer, 999);
+		buffer[n < 0 ? 0 : n] = '\0';
+		if(strcmp(buffer, "ACK")) codec = SILPI_CODEC_RAW;
+		printf(BLD "    main" NRM ": packed events -> %s\n", buffer);
+	}
+	if(specmode) {
+		//the spectrum of this run starts from zero (for every spectrum viewer of this server)
+		n = query(context, &requester, host, ident, "specclear", buffer, 999);
+		buffer[n < 0 ? 0 : n] = '\0';
+		printf(BLD "    main" NRM ": spectrum clear -> %s\n", buffer);
+	}
+	n = query(context, &requester, host, ident, "start", buffer, 999);
+	buffer[n < 0 ? 0 : n] = '\0';
 	printf(BLD "    main" NRM ": START -> %s\n", buffer);
 	
 	signal(SIGINT,sigh);
 	printf(GRN "***** Press CTRL+C to stop and close the acquisition client *****\n\n");
 	
-	int flags;
+	int flags = 0, j0, fresh = 0;
+	uint32_t occ = 0;
+	char cmd[40];
 	struct Silevent data[SIZE];
+	static uint8_t packed[SILPI_CODEC_BOUND(SIZE)];
+	struct Silbatch batch;
 	uint64_t t0 = 0, tall = 0, tdead = 0, lasttall = 0, lasttdead = 0;
-	uint64_t spec[65536], M = 1, N = 0, lastN = 0;
+	uint64_t spec[65536], M = 1, N = 0, lastN = 0, lost = 0;
+	uint64_t nextpos = 0, specver = 0;
+	struct Silspecdelta sd;
+	uint32_t nextseq = 0;
+	int seqok = 0, posok = 0;
 	for(int j = 0; j < 65536; j++) spec[j] = 0;
 	
 	printf("\n");
@@ -110,9 +245,50 @@ int main(int argc, char *argv[]) {
 	uint64_t usec, msec, lastmsec = 0;
 	gettimeofday(&ti, NULL);
 	for(;go;) {
-		zmq_send(requester, "send", 5, 0); //5 byte: c'è il carattere terminatore '\0'!!
-		n = zmq_recv(requester, data, SIZE * sizeof(struct Silevent), 0);
+		//batch header, then events
+		//requested batches start where the previous one ended: the server keeps them until this position
+		//is acknowledged by the next request, a lost reply is simply sent again
+		void *src = streamer;
+		if(streamer) n = zmq_recv(streamer, &batch, sizeof(batch), 0);
+		else if(specmode) {
+			//no events: the spectrum and the totals come from the server
+			if(spec_update(context, &requester, host, ident, &specver, spec, &sd) == 0) {
+				N     = sd.events;
+				tall  = sd.tstop - sd.tstart;
+				tdead = sd.dead;
+			}
+			usleep(200000);
+			n = -1;
+		}
+		else {
+			if(posok) sprintf(cmd, "get %" PRIu64, nextpos);
+			else sprintf(cmd, "get");
+			n = query(context, &requester, host, ident, cmd, &batch, sizeof(batch));
+			src = requester;
+		}
 		if(!go) break;
+		j0 = 0;
+		if(n < 0) n = 0;
+		else if(n != sizeof(batch) || batch.magic != SILPI_BATCH_MAGIC) {
+			printf(UP YEL "    main" NRM ": bad batch header\n\n");
+			drain(src);
+			n = 0;
+		}
+		else {
+			//server status comes with the data
+			flags = batch.flags;
+			occ   = batch.occ;
+			fresh = 1;
+			if(batch.codec == SILPI_CODEC_PACK) n = unpack(packed, zmq_recv(src, packed, sizeof(packed), 0), data);
+			else n = zmq_recv(src, data, SIZE * sizeof(struct Silevent), 0);
+			if(n < 0) n = 0;
+			if(streamer == NULL) {
+				//events already received (resent batch) are skipped
+				if(posok && batch.first < nextpos) j0 = (nextpos - batch.first < batch.count) ? (int)(nextpos - batch.first) : (int)batch.count;
+				if(posok == 0 || batch.first + batch.count > nextpos) nextpos = batch.first + batch.count;
+				posok = 1;
+			}
+		}
 		
 		if(n % sizeof(struct Silevent)) {
 			printf(UP RED "    main" NRM ": read fraction of event (size = %d)\n\n", n);
@@ -120,7 +296,13 @@ int main(int argc, char *argv[]) {
 		}
 		n /= sizeof(struct Silevent);
 		
-		for(int j = 0; j < n; j++) {
+		for(int j = j0; j < n; j++) {
+			//sequence gaps are records lost on the way
+			if(seqok && data[j].seq != nextseq) lost += (uint32_t)(data[j].seq - nextseq);
+			nextseq = data[j].seq + 1;
+			seqok = 1;
+			if(data[j].type != SILPI_REC_EVENT) continue;
+			
 			if(t0 == 0) {
 				//always skip first M non-zero events (used as start time mark, first is usually not reliable)
 				t0 = data[j].ts + (uint64_t)(data[j].dt);
@@ -142,12 +324,12 @@ int main(int argc, char *argv[]) {
 		usec = (uint64_t)td.tv_usec + 1000000L * (uint64_t)td.tv_sec;
 		msec = (usec + 500L) / 1000L;
 		if(msec - lastmsec >= 1000L) {
-			//ask status to server
-			zmq_send(requester, "stat", 5, 0);
-			n = zmq_recv(requester, &flags, sizeof(int), 0);
+			//ask status to server only if no batch header brought it (idle streaming channel)
+			if(fresh == 0) query(context, &requester, host, ident, "stat", &flags, sizeof(int));
+			fresh = 0;
 			
 			//status update every second
-			printf(UP BLD "   *****" NRM " uptime =%6lu s, tot.ev = %10lu, status =%s, i-rate =%6.0lf Hz, i-d.time =%3.0lf %%\n", msec / 1000L, N, (flags&F_PAUSE) ? (YEL "PAUSE" NRM) : ((flags&F_RUN) ? (GRN " RUN " NRM) : (RED " STOP" NRM)), 1000. * ((double)(N - lastN)) / ((double)(msec - lastmsec)), tall == lasttall ? 0 : 100. * ((double)(tdead - lasttdead)) / ((double)(tall - lasttall)));
+			printf(UP BLD "   *****" NRM " uptime =%6lu s, tot.ev = %10lu, lost = %6lu, status =%s, i-rate =%6.0lf Hz, i-d.time =%3.0lf %%, buffer =%3.0lf %%\n", msec / 1000L, N, lost, (flags&F_PAUSE) ? (YEL "PAUSE" NRM) : ((flags&F_RUN) ? (GRN " RUN " NRM) : (RED " STOP" NRM)), 1000. * ((double)(N - lastN)) / ((double)(msec - lastmsec)), tall == lasttall ? 0 : 100. * ((double)(tdead - lasttdead)) / ((double)(tall - lasttall)), 100. * ((double)occ) / ((double)SIZE));
 			lastN = N;
 			lasttall = tall;
 			lasttdead = tdead;
@@ -163,13 +345,12 @@ int main(int argc, char *argv[]) {
 	}
 	if(f) pclose(f);
 	
-	//receive remaining events
-	zmq_recv(requester, data, SIZE * sizeof(struct Silevent), 0);
+	//an interrupted request left the old socket (see query)
+	if(streamer) zmq_close(streamer);
 	
 	//STOP Silena ADC
-	zmq_send(requester, "stop", 5, 0);
-	n = zmq_recv(requester, buffer, 999, 0);
-	buffer[n] = '\0';
+	n = query(context, &requester, host, ident, "stop", buffer, 999);
+	buffer[n < 0 ? 0 : n] = '\0';
 	printf(BLD "    main" NRM ":  STOP -> %s\n", buffer);
 	zmq_close(requester);
 	zmq_ctx_destroy(context);
@@ -21,6 +21,7 @@
 
 #include "../include/SilCli_root.h"
 #include "../include/SilStruct.h"
+#include "../include/SilCodec.h"
 
 #define WINDOWX 1500
 #define WINDOWY 800
@@ -35,13 +36,15 @@
 #define FETCHINT 100000
 //Histograms and Graphs update interval (in ms)
 #define HISTUP     5000L
+//Data requests without reply before giving up the server (the same events are requested again meanwhile)
+#define MAXMISS      50
 
 static MyMainFrame *me;
 pid_t cproc;
 bool go, fen;
 
 uint64_t ts;
-uint32_t dt;
+uint32_t dt, seq;
 uint16_t val, emask;
 
 //Parent signal handler
@@ -80,26 +83,75 @@ void handlesig_child(int sig) {
 	return;
 }
 
+//server address from the client configuration file (shared with SilCli_gnuplot): RPi host and ADC number
+//the server of ADC n listens on port 4747 + n. Returns the port
+int MyMainFrame::Config(const char *fn, char *host, const size_t size) {
+	char buffer[1000], par[1000], pardata[1000];
+	int adc = 0;
+	
+	FILE *f = fopen(fn, "r");
+	if(f == nullptr) return 4747;
+	while(fgets(buffer, sizeof(buffer), f)) {
+		if(sscanf(buffer, "%s %[^\n]", par, pardata) < 2 || par[0] == '#') continue;
+		if(strcmp(par, "host") == 0) snprintf(host, size, "%s", pardata);
+		if(strcmp(par, "adc") == 0) adc = atoi(pardata);
+	}
+	fclose(f);
+	if(adc < 0) adc = 0;
+	printf("[parent] %s: ADC %d on %s (port %d)\n", fn, adc, host, 4747 + adc);
+	return 4747 + adc;
+}
+
+//REQ socket with the identity of this client and a 100 ms timeout
+void *MyMainFrame::Open() {
+	int N = 100, linger = 0;
+	void *req = zmq_socket(context, ZMQ_REQ);
+	
+	zmq_setsockopt(req, ZMQ_ROUTING_ID, fIdent, strlen(fIdent));
+	zmq_setsockopt(req, ZMQ_LINGER, &linger, sizeof(linger));
+	if(zmq_setsockopt(req, ZMQ_RCVTIMEO, &N, sizeof(N))) {
+		perror("[parent] zmq_setsockopt");
+	}
+	return req;
+}
+
+//a REQ socket still waiting for a reply cannot send: it is replaced by a new one with the same identity
+//(the server hands the client over to the new connection, with its cursor and unacknowledged events)
+bool MyMainFrame::Reopen() {
+	char buffer[1000];
+	
+	printf("[parent] reconnecting\n");
+	zmq_close(requester);
+	requester = Open();
+	qtype = 0;
+	snprintf(buffer, sizeof(buffer), "tcp://%s:%d", tehost->GetText(), fPort);
+	if(zmq_connect(requester, buffer)) {
+		perror("[parent] zmq_connect");
+		return false;
+	}
+	return true;
+}
+
 int MyMainFrame::Query(void *requester, const void *q, const size_t &qlen, void *ans, const size_t &alen, const int &type) {
 	if(fTest) return 0;
 	if(requester == nullptr) return -1;
 	if(qtype) {
+		//late reply to the previous request: every frame is discarded (lost data are requested again, see Fetch)
 		printf("[parent] emptying buffer!\n");
-		if(qtype == QTYPE_BUF) {
-			char buffer[1000];
-			int N = zmq_recv(requester, buffer, 999, 0);
+		int more = 1;
+		size_t len = sizeof(more);
+		zmq_msg_t msg;
+		while(more) {
+			zmq_msg_init(&msg);
+			int N = zmq_msg_recv(&msg, requester, 0);
+			zmq_msg_close(&msg);
 			if(N < 0) {
 				perror("[parent] zmq_recv");
-				return -1;
-			}
-		}
-		else if(qtype == QTYPE_DAT) {
-			struct Silevent data[SIZE];
-			int N = zmq_recv(requester, data, SIZE * sizeof(struct Silevent), 0);
-			if(N < 0) {
-				perror("[parent] zmq_recv");
-				return -1;
+				if(!Reopen()) return -1;
+				requester = this->requester;
+				break;
 			}
+			if(zmq_getsockopt(requester, ZMQ_RCVMORE, &more, &len)) more = 0;
 		}
 		qtype = 0;
 	}
@@ -127,20 +179,17 @@ void MyMainFrame::Connect() {
 	}
 	
 	char buffer[1000];
-	int N = 100; //setting a 100ms timeout!
+	int N;
 	
 	if(!fTest) {
 		if(context) printf("[parent] ZMQ context already exists!\n");
 		else context = zmq_ctx_new();
 		if(requester) printf("[parent] ZMQ socket already exists!\n");
-		else requester = zmq_socket(context, ZMQ_REQ);
-		if(zmq_setsockopt(requester, ZMQ_RCVTIMEO, &N, sizeof(N))) {
-			perror("[parent] zmq_setsockopt");
-		}
+		else requester = Open();
 		
 		lout->SetText("Connection failed!");
 		
-		sprintf(buffer, "tcp://%s:4747", tehost->GetText());
+		snprintf(buffer, sizeof(buffer), "tcp://%s:%d", tehost->GetText(), fPort);
 		printf("[parent] connecting to %s\n", buffer);
 		if(zmq_connect(requester, buffer)) {
 			perror("[parent] zmq_connect");
@@ -171,6 +220,11 @@ void MyMainFrame::Connect() {
 			context = nullptr;
 			return;
 		}
+		
+		//packed data replies (3-4 times smaller on Wi-Fi links), if the server knows them
+		N = Query(requester, "codec", 6, buffer, 999, QTYPE_BUF);
+		fPack = (N == 4 && strcmp(buffer, "ACK") == 0);
+		printf("[parent] packed events -> %s\n", fPack ? "ACK" : "NAK");
 	}
 	
 	lout->SetText("Ready to start acquisition!");
@@ -226,6 +280,7 @@ void MyMainFrame::SetupTree() {
 	tree->Branch("dt", &dt, "dt/i");
 	tree->Branch("val", &val, "val/s");
 	tree->Branch("emask", &emask, "emask/s");
+	tree->Branch("seq", &seq, "seq/i");
 	return;
 }
 
@@ -403,7 +458,9 @@ void MyMainFrame::Start() {
 	}
 	gettimeofday(&ti, NULL);
 	t0 = 0; lastts = 0; tall = 0; tdead = 0; tpaused = 0; lasttall = 0; lasttdead = 0; lastN = 0;
-	Nev = 0; Nerr = 0; lastup = 0; buffil = 0; Nbuf = 0;
+	Nev = 0; Nerr = 0; Nlost = 0; lastup = 0; buffil = 0; Nbuf = 0;
+	toff = 0; nextseq = 0; seqok = false;
+	nextpos = 0; posok = false; fMiss = 0; sflags = 0;
 	
 	int sec = (ti.tv_sec % 86400L) / 60L;
 	testart->SetText(Form("%02d:%02d", sec / 60, sec % 60));
@@ -543,24 +600,75 @@ void MyMainFrame::Fetch() {
 	}
 	
 	struct Silevent data[SIZE];
+	struct Silbatch batch;
 	struct timeval tf, td;
+	char q[40];
 	
-	int N = Query(requester, "send", 5, data, SIZE * sizeof(struct Silevent), QTYPE_DAT);
+	//sequenced batches: "get <pos>" acknowledges the events before pos, the server keeps the others
+	//a late or lost reply is not a disconnection, the same events are requested at next fetch
+	if(posok) sprintf(q, "get %lu", nextpos);
+	else sprintf(q, "get");
+	int N = Query(requester, q, strlen(q) + 1, &batch, sizeof(batch), QTYPE_DAT);
 	if(N < 0) {
+		if(++fMiss < MAXMISS) return;
 		lout->SetText("Server connection failed");
 		PiDisconnect();
 		return;
 	}
+	fMiss = 0;
+	if(N != sizeof(batch) || batch.magic != SILPI_BATCH_MAGIC) {
+		printf("[parent] bad batch header (size = %d)\n", N);
+		return;
+	}
+	
+	//server status comes with the data, no separate round trip
+	if((batch.flags ^ sflags) & F_PAUSE) {
+		printf("[parent] server %s\n", (batch.flags & F_PAUSE) ? "paused (full buffer)" : "resumed");
+		testat->SetText(stat[(batch.flags & F_PAUSE) ? STAT_PAUS : istat]);
+	}
+	sflags = batch.flags;
+	buffil += (double)batch.occ;
+	Nbuf += 1;
+	if(batch.codec == SILPI_CODEC_PACK) {
+		static uint8_t packed[SILPI_CODEC_BOUND(SIZE)];
+		N = zmq_recv(requester, packed, sizeof(packed), 0);
+		if(N >= 0) {
+			int64_t count = codec_decode(packed, (size_t)N, data, SIZE);
+			if(count < 0) {
+				printf("[parent] bad packed frame (size = %d)\n", N);
+				count = 0;
+			}
+			N = (int)count * (int)sizeof(struct Silevent);
+		}
+	}
+	else N = zmq_recv(requester, data, SIZE * sizeof(struct Silevent), 0);
+	if(N < 0) N = 0;
+	
+	//events already received (resent batch) are skipped
+	int j0 = 0;
+	if(posok && batch.first < nextpos) j0 = (nextpos - batch.first < batch.count) ? (int)(nextpos - batch.first) : (int)batch.count;
+	if(!posok || batch.first + batch.count > nextpos) nextpos = batch.first + batch.count;
+	posok = true;
 	
 	if(N % sizeof(struct Silevent)) {
 		printf("[parent] read fraction of event (size = %d)\n", N);
 	}
 	N /= sizeof(struct Silevent);
-	buffil += (double)N;
-	Nbuf += 1;
 	
-	ts = 0; dt = 0;
-	for(int j = 0; j < N; j++) {
+	uint64_t tend = 0, lost = Nlost;
+	for(int j = j0; j < N; j++) {
+		//sequence gaps are records lost on the way
+		if(seqok && data[j].seq != nextseq) Nlost += (uint32_t)(data[j].seq - nextseq);
+		nextseq = data[j].seq + 1;
+		seqok = true;
+		if(data[j].type == SILPI_REC_ANCHOR) {
+			struct Silanchor anchor;
+			memcpy(&anchor, &data[j], sizeof(anchor));
+			toff = anchor.rt - anchor.ts;
+			continue;
+		}
+		if(data[j].type != SILPI_REC_EVENT) continue;
+		
 		if(t0 == 0L) {
 			if(data[j].ts > 100L) t0 = 1L;
 			continue;
@@ -581,14 +689,18 @@ void MyMainFrame::Fetch() {
 		Nev++;
 		if(data[j].emask) Nerr++;
 		lastts = data[j].ts;
+		tend = data[j].ts + (uint64_t)(data[j].dt);
 		
-		ts = data[j].ts; dt = data[j].dt;
+		//tree timestamps are UTC (ns from 1/1/1970)
+		ts = data[j].ts + toff; dt = data[j].dt;
 		val = data[j].val; emask = data[j].emask;
+		seq = data[j].seq;
 		tree->Fill();
 	}
-	if(ts) {
-		tall = (ts + (uint64_t)dt - t0) / 1000L - tpaused;
+	if(tend) {
+		tall = (tend - t0) / 1000L - tpaused;
 	}
+	if(Nlost > lost) printf("[parent] %lu records lost (%lu in total)\n", Nlost - lost, Nlost);
 	
 	gettimeofday(&tf, NULL);
 	timersub(&tf, &ti, &td);
@@ -663,13 +775,23 @@ MyMainFrame::MyMainFrame(const TGWindow *p, UInt_t w, UInt_t h) {
 	istat     = STAT_NCFG;
 	fTest     = false;
 	fPause    = false;
+	fPack     = false;
 	context   = nullptr;
 	requester = nullptr;
 	fout      = nullptr;
 	hbkg      = nullptr;
 	qtype     = 0;
+	fMiss     = 0;
 	fcnt      = 0;
 	
+	char pihost[200] = "10.253.2.47";
+	fPort = Config("SilCli.cfg", pihost, sizeof(pihost));
+	
+	char host[200];
+	gethostname(host, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+	snprintf(fIdent, sizeof(fIdent), "root@%s:%d", host, (int)getpid());
+	
 	FontStruct_t font_sml = gClient->GetFontByName("-*-arial-regular-r-*-*-16-*-*-*-*-*-iso8859-1");
 	FontStruct_t font_big = gClient->GetFontByName("-*-arial-regular-r-*-*-24-*-*-*-*-*-iso8859-1");
 	FontStruct_t font_lrg = gClient->GetFontByName("-*-arial-bold-r-*-*-32-*-*-*-*-*-iso8859-1");
@@ -714,7 +836,7 @@ MyMainFrame::MyMainFrame(const TGWindow *p, UInt_t w, UInt_t h) {
 				lhost->SetTextFont(font_sml);
 				hf21->AddFrame(lhost, new TGLayoutHints(kLHintsCenterY|kLHintsExpandX, 2, 1, 2, 2));
 				
-				tehost = new TGTextEntry(hf21, "10.253.2.47");
+				tehost = new TGTextEntry(hf21, pihost);
 				tehost->SetFont(font_sml);
 				tehost->Resize(188, 24);
 				tehost->SetAlignment(kTextLeft);
@@ -748,7 +870,7 @@ MyMainFrame::MyMainFrame(const TGWindow *p, UInt_t w, UInt_t h) {
 				cbbits->Resize(300, 24);
 				cbbits->SetEnabled(kFALSE);
 				hf22->AddFrame(cbbits, new TGLayoutHints(kLHintsCenterY, 1, 2, 2, 2));
-				
+			
 			}
 			//hf22 ends
 			vf20->AddFrame(hf22, new TGLayoutHints(kLHintsExpandX|kLHintsCenterX|kLHintsCenterY, 2, 2, 2, 2));
@@ -0,0 +1,257 @@
+/*******************************************************************************
+*                                                                              *
+*                         Simone Valdre' - 16/10/2026                          *
+*                  distributed under GPL-3.0-or-later licence                  *
+*                                                                              *
+*******************************************************************************/
+
+// SilServ on-Pi raw event recorder
+// The recorder is one more consumer of the shared ring, with DROP policy: if the disk
+// is too slow it loses events (sequence gaps in the files), never the acquisition.
+// Events are staged in page-aligned blocks and written asynchronously (POSIX AIO)
+// with O_DIRECT where the file system supports it, so a disk hiccup only costs
+// staging blocks. Files hold raw Silevent records (anchors included).
+
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <aio.h>
+#include <inttypes.h>
+
+#include "../include/SilStruct.h"
+#include "../include/SilShared.h"
+#include "../include/SilRec.h"
+#include "../include/ShellColors.h"
+
+#define REC_ALIGN  4096              // O_DIRECT granularity of buffers, offsets and lengths
+#define REC_BLOCK  (255 * REC_ALIGN) // about 1 MB, whole pages and whole events
+#define REC_NBLOCK 8                 // staging blocks
+#define REC_NAIO   (2 * REC_NBLOCK)  // writes in flight
+
+static int rstate = 0;
+
+void recsig(int num) {
+	switch(num) {
+		case SIGUSR2: rstate=-1; break;
+		case SIGINT: rstate=-1;
+	}
+}
+
+struct recfile {
+	int fd, direct, index;
+	off_t off;                 // file offset of the next write
+	time_t open;               // opening time
+	char *block[REC_NBLOCK];   // staging blocks (REC_ALIGN aligned)
+	int busy[REC_NBLOCK];      // writes in flight from each block
+	int cur;                   // block being filled...
+	size_t fill, done;         // ...its staged bytes and the ones already submitted
+	struct aiocb cb[REC_NAIO];
+	int cbblk[REC_NAIO];       // block of each write (-1 = free)
+	struct aiocb sync;
+	int syncing;
+};
+
+static int rec_open(struct recfile *rf, const struct reccfg *cfg) {
+	char fn[600];
+	struct tm tm;
+	
+	rf->open = time(NULL);
+	localtime_r(&(rf->open), &tm);
+	snprintf(fn, sizeof(fn), "%s/silpi%d_%04d%02d%02d-%02d%02d%02d_%04d.raw", cfg->dir, cfg->adc, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, rf->index++);
+	
+	//O_DIRECT skips the page cache: the blocks go straight to the device
+	rf->direct = 1;
+	rf->fd = open(fn, O_WRONLY|O_CREAT|O_EXCL|O_DIRECT, 0644);
+	if(rf->fd < 0 && errno == EINVAL) {
+		//file system without O_DIRECT (e.g. tmpfs)
+		rf->direct = 0;
+		rf->fd = open(fn, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	}
+	if(rf->fd < 0) {
+		perror(RED "recorder" NRM);
+		return -1;
+	}
+	rf->off = 0;
+	printf(UP BLD "recorder" NRM ": writing %s%s\n\n", fn, rf->direct ? "" : " (buffered)");
+	return 0;
+}
+
+//collects the completed writes, all of them if wait is set (-1 on write errors)
+static int rec_reap(struct recfile *rf, const int wait) {
+	const struct aiocb *list[1];
+	int i, err, ret = 0;
+	
+	for(i=0; i<REC_NAIO; i++) {
+		if(rf->cbblk[i] < 0) continue;
+		list[0] = &(rf->cb[i]);
+		while((err = aio_error(&(rf->cb[i]))) == EINPROGRESS && wait) aio_suspend(list, 1, NULL);
+		if(err == EINPROGRESS) continue;
+		if(aio_return(&(rf->cb[i])) != (ssize_t)(rf->cb[i].aio_nbytes)) {
+			printf(UP RED "recorder" NRM ": write error (%s)\n\n", err ? strerror(err) : "short write");
+			ret = -1;
+		}
+		rf->busy[rf->cbblk[i]]--;
+		rf->cbblk[i] = -1;
+	}
+	if(rf->syncing) {
+		list[0] = &(rf->sync);
+		while((err = aio_error(&(rf->sync))) == EINPROGRESS && wait) aio_suspend(list, 1, NULL);
+		if(err != EINPROGRESS) {
+			if(aio_return(&(rf->sync))) printf(UP YEL "recorder" NRM ": sync error (%s)\n\n", strerror(err));
+			rf->syncing = 0;
+		}
+	}
+	return ret;
+}
+
+//asynchronous write of the current block, from the submitted bytes up to end (a multiple of REC_ALIGN)
+static int rec_submit(struct recfile *rf, const size_t end) {
+	int i;
+	
+	for(;;) {
+		for(i=0; i<REC_NAIO; i++) {
+			if(rf->cbblk[i] < 0) break;
+		}
+		if(i < REC_NAIO) break;
+		if(rec_reap(rf, 1)) return -1;
+	}
+	memset(&(rf->cb[i]), 0, sizeof(struct aiocb));
+	rf->cb[i].aio_fildes = rf->fd;
+	rf->cb[i].aio_buf    = rf->block[rf->cur] + rf->done;
+	rf->cb[i].aio_nbytes = end - rf->done;
+	rf->cb[i].aio_offset = rf->off;
+	if(aio_write(&(rf->cb[i]))) {
+		perror(RED "recorder" NRM);
+		return -1;
+	}
+	rf->cbblk[i] = rf->cur;
+	rf->busy[rf->cur]++;
+	rf->off += (off_t)(end - rf->done);
+	rf->done = end;
+	return 0;
+}
+
+//bounded sync: what is staged goes to disk (whole pages only), then an asynchronous fdatasync
+static int rec_sync(struct recfile *rf) {
+	size_t aligned = rf->fill & ~(size_t)(REC_ALIGN - 1);
+	
+	if(aligned > rf->done && rec_submit(rf, aligned)) return -1;
+	if(rf->syncing) return 0;
+	memset(&(rf->sync), 0, sizeof(struct aiocb));
+	rf->sync.aio_fildes = rf->fd;
+	if(aio_fsync(O_DSYNC, &(rf->sync))) {
+		perror(YEL "recorder" NRM);
+		return 0;
+	}
+	rf->syncing = 1;
+	return 0;
+}
+
+//the last partial page is written without O_DIRECT, files always hold whole events
+static int rec_close(struct recfile *rf) {
+	int ret = rec_reap(rf, 1);
+	ssize_t n;
+	
+	if(rf->fill > rf->done) {
+		if(rf->direct) fcntl(rf->fd, F_SETFL, fcntl(rf->fd, F_GETFL) & ~O_DIRECT);
+		n = pwrite(rf->fd, rf->block[rf->cur] + rf->done, rf->fill - rf->done, rf->off);
+		if(n != (ssize_t)(rf->fill - rf->done)) {
+			perror(RED "recorder" NRM);
+			ret = -1;
+		}
+	}
+	if(fdatasync(rf->fd)) perror(YEL "recorder" NRM);
+	close(rf->fd);
+	rf->fd = -1;
+	rf->cur = 0;
+	rf->fill = 0;
+	rf->done = 0;
+	return ret;
+}
+
+//recorder process: returns when SIGUSR2 or SIGINT is received, or on write errors
+int rec_run(struct Silshared *buf, const struct reccfg *cfg, const int recfd) {
+	struct recfile rf;
+	struct pollfd pfd = {recfd, POLLIN, 0};
+	uint64_t wakes, dropped = 0, d;
+	uint32_t n;
+	time_t now, lastsync;
+	int i, id, ret = 0;
+	
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGUSR2, recsig);
+	signal(SIGINT, recsig);
+	
+	memset(&rf, 0, sizeof(rf));
+	rf.fd = -1;
+	for(i=0; i<REC_NAIO; i++) rf.cbblk[i] = -1;
+	for(i=0; i<REC_NBLOCK; i++) {
+		if(posix_memalign((void **)&(rf.block[i]), REC_ALIGN, REC_BLOCK)) {
+			printf(RED "recorder" NRM ": out of memory\n");
+			return -1;
+		}
+	}
+	id = shm_attach(buf, SILPI_CONS_DROP);
+	if(id < 0) {
+		printf(RED "recorder" NRM ": no free cursor in the shared ring\n");
+		return -1;
+	}
+	printf(BLD "recorder" NRM ": PID = %d, recording in %s\n", getpid(), cfg->dir);
+	
+	lastsync = time(NULL);
+	while(ret == 0) {
+		//waiting for new events (or the next sync and rotation check)
+		if(poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+			perror(RED "recorder" NRM);
+			break;
+		}
+		if(pfd.revents & POLLIN) {
+			if(read(recfd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) perror(RED "recorder" NRM);
+		}
+		
+		//events are staged until a block is full, then it is written while the next one fills up
+		while(ret == 0 && shm_count(buf, id) > 0) {
+			if(rf.fd < 0 && (ret = rec_open(&rf, cfg))) break;
+			n = shm_read(buf, id, (struct Silevent *)(rf.block[rf.cur] + rf.fill), (uint32_t)((REC_BLOCK - rf.fill) / sizeof(struct Silevent)));
+			rf.fill += n * sizeof(struct Silevent);
+			if(rf.fill < REC_BLOCK) continue;
+			
+			if((ret = rec_submit(&rf, REC_BLOCK))) break;
+			rf.cur = (rf.cur + 1) % REC_NBLOCK;
+			rf.fill = 0;
+			rf.done = 0;
+			//every block in flight: the disk is slower than the acquisition, events wait in the ring (and may be dropped)
+			if(rf.busy[rf.cur]) ret = rec_reap(&rf, 1);
+			if(ret == 0 && cfg->size && (uint64_t)(rf.off) >= cfg->size) ret = rec_close(&rf);
+		}
+		if(ret == 0 && rf.fd >= 0) ret = rec_reap(&rf, 0);
+		
+		now = time(NULL);
+		if(ret == 0 && rf.fd >= 0 && cfg->time && now - rf.open >= cfg->time) ret = rec_close(&rf);
+		if(ret == 0 && rf.fd >= 0 && now - lastsync >= cfg->sync) {
+			ret = rec_sync(&rf);
+			lastsync = now;
+		}
+		
+		d = __atomic_load_n(&(buf->cons[id].dropped), __ATOMIC_RELAXED);
+		if(d != dropped) {
+			printf(UP YEL "recorder" NRM ": %" PRIu64 " events lost, the disk is too slow\n\n", d - dropped);
+			dropped = d;
+		}
+		if(rstate < 0) break;
+	}
+	
+	if(ret) printf(RED "recorder" NRM ": recording stopped, the acquisition goes on\n");
+	if(rf.fd >= 0 && rec_close(&rf)) ret = -1;
+	shm_detach(buf, id);
+	for(i=0; i<REC_NBLOCK; i++) free(rf.block[i]);
+	printf(BLD "recorder" NRM ": closed\n");
+	return ret;
+}
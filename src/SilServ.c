@@ -5,8 +5,11 @@
 *                                                                              *
 *******************************************************************************/
 
+#define _GNU_SOURCE // sched_setaffinity
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,256 +18,1137 @@
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
 #include <zmq.h>
 
 #include "../include/SilStruct.h"
 #include "../include/SilShared.h"
+#include "../include/SilRec.h"
+#include "../include/SilCodec.h"
 #include "../include/ShellColors.h"
 
 static int pstate=0, cstate=0;
 
+//server configuration (see SilServ.cfg)
+struct servcfg {
+	int stream;      // streaming socket type: ZMQ_PUSH, ZMQ_PUB or 0 (off)
+	int stream_port; // streaming port
+	int hwm;         // streaming high-water mark (batches)
+	int codec;       // streaming encoding: SILPI_CODEC_RAW or SILPI_CODEC_PACK
+	int policy;      // SILPI_CONS_BLOCK or SILPI_CONS_DROP for new clients
+	int idle;        // seconds without requests before a client is released
+	struct reccfg rec; // on-Pi recorder
+	char spool[500]; // spool directory ("" = off: slow BLOCK clients pause the acquisition)
+	int metrics;     // HTTP port of the Prometheus metrics (0 = off)
+	int latency;     // read latency target (us)
+	int rt_prio;     // SCHED_FIFO priority of the device reader (0 = off)
+	int cpu_reader;  // CPU of the device reader (-1 = any)
+	int cpu_net;     // CPU of the 0MQ server (-1 = any)
+	int mlock;       // locked memory (mlockall) for reader and 0MQ server
+	int huge;        // shared ring in huge pages
+};
+
+//directory from the config file ("off" = none): a longer path than dst holds is refused, not truncated
+void cfg_dir(char *dst, const size_t size, const char *par, const char *pardata) {
+	size_t len = strlen(pardata);
+	
+	if(strcmp(pardata, "off") == 0) dst[0] = '\0';
+	else if(len >= size) printf(YEL "  main" NRM ": %s directory longer than %lu characters, ignored\n", par, (unsigned long)(size - 1));
+	else memcpy(dst, pardata, len + 1);
+}
+
+void read_config(const char *fn, struct servcfg *cfg, const int port, const int adc) {
+	char buffer[1000], par[1000], pardata[900];
+	int comment;
+	
+	cfg->stream      = 0;
+	cfg->stream_port = port + 100;
+	cfg->hwm         = 100;
+	cfg->codec       = SILPI_CODEC_RAW;
+	cfg->policy      = SILPI_CONS_DROP;
+	cfg->idle        = 10;
+	cfg->rec.dir[0]  = '\0';
+	cfg->spool[0]    = '\0';
+	cfg->metrics     = 0;
+	cfg->latency     = 10000;
+	cfg->rt_prio     = 0;
+	cfg->cpu_reader  = -1;
+	cfg->cpu_net     = -1;
+	cfg->mlock       = 0;
+	cfg->huge        = 0;
+	cfg->rec.adc     = adc;
+	cfg->rec.size    = 1024ULL << 20;
+	cfg->rec.time    = 3600;
+	cfg->rec.sync    = 5;
+	
+	FILE *f = fopen(fn, "r");
+	if(f == NULL) {
+		printf(YEL "  main" NRM ": config file %s not found. Using default values!\n", fn);
+		return;
+	}
+	for(;;) {
+		if(fgets(buffer, 1000, f) == NULL) break;
+		comment = 0;
+		for(size_t i = 0; i < strlen(buffer); i++) {
+			if(buffer[i] == '#') {
+				comment = 1;
+				break;
+			}
+			if(buffer[i] != ' ') break;
+		}
+		if(comment) continue;
+		if(sscanf(buffer, "%s %[^\n]", par, pardata) < 2) continue;
+		
+		if(strcmp(par, "stream") == 0) {
+			if(strcmp(pardata, "push") == 0) cfg->stream = ZMQ_PUSH;
+			else if(strcmp(pardata, "pub") == 0) cfg->stream = ZMQ_PUB;
+			else cfg->stream = 0;
+		}
+		if(strcmp(par, "stream_port") == 0) cfg->stream_port = atoi(pardata);
+		if(strcmp(par, "hwm") == 0) cfg->hwm = atoi(pardata);
+		if(strcmp(par, "stream_codec") == 0) cfg->codec = (strcmp(pardata, "pack") == 0) ? SILPI_CODEC_PACK : SILPI_CODEC_RAW;
+		if(strcmp(par, "policy") == 0) cfg->policy = (strcmp(pardata, "block") == 0) ? SILPI_CONS_BLOCK : SILPI_CONS_DROP;
+		if(strcmp(par, "idle") == 0) cfg->idle = atoi(pardata);
+		if(strcmp(par, "record") == 0) cfg_dir(cfg->rec.dir, sizeof(cfg->rec.dir), par, pardata);
+		if(strcmp(par, "spool") == 0) cfg_dir(cfg->spool, sizeof(cfg->spool), par, pardata);
+		if(strcmp(par, "record_size") == 0) cfg->rec.size = strtoull(pardata, NULL, 10) << 20;
+		if(strcmp(par, "record_time") == 0) cfg->rec.time = atoi(pardata);
+		if(strcmp(par, "record_sync") == 0) cfg->rec.sync = atoi(pardata);
+		if(strcmp(par, "metrics_port") == 0) cfg->metrics = atoi(pardata);
+		if(strcmp(par, "latency") == 0) cfg->latency = (int)(1000. * atof(pardata));
+		if(strcmp(par, "rt_priority") == 0) cfg->rt_prio = atoi(pardata);
+		if(strcmp(par, "cpu_reader") == 0) cfg->cpu_reader = strcmp(pardata, "off") ? atoi(pardata) : -1;
+		if(strcmp(par, "cpu_net") == 0) cfg->cpu_net = strcmp(pardata, "off") ? atoi(pardata) : -1;
+		if(strcmp(par, "mlock") == 0) cfg->mlock = (strcmp(pardata, "on") == 0);
+		if(strcmp(par, "hugepages") == 0) cfg->huge = (strcmp(pardata, "on") == 0);
+	}
+	fclose(f);
+	if(cfg->latency < 1000) cfg->latency = 1000;
+	return;
+}
+
 void parsig(int num) {
 	switch(num) {
-		case SIGUSR1: if(pstate>=0) pstate++; break;
 		case SIGUSR2: pstate=-1; break;
 		case SIGINT: pstate=-1; printf("***** PARENT SIGINT CATCHED *****\n\n");
 	}
 }
 
+//CLOCK_MONOTONIC_RAW (ns), the clock of the event timestamps
+uint64_t raw_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000L + (uint64_t)ts.tv_nsec;
+}
+
+//the reader publishes its counters for the 0MQ server, field by field
+void stats_publish(struct Silshared *buf, const struct Silstats *st) {
+	__atomic_store_n(&(buf->stats.events), st->events, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.rate), st->rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.pauses), st->pauses, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.paused), st->paused, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.spooled), st->spooled, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.cpu), st->cpu, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.occ), st->occ, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.occmax), st->occmax, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.retunes), st->retunes, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.wm_events), st->wm_events, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.wm_timeout), st->wm_timeout, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.interval), st->interval, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.latency), st->latency, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.runlat), st->runlat, __ATOMIC_RELAXED);
+	__atomic_store_n(&(buf->stats.runlatmax), st->runlatmax, __ATOMIC_RELAXED);
+}
+
+//startup: the 0MQ server writes startfd with its sockets bound, a failure arrives as SIGUSR2
+//returns 0 when the child is ready, -1 on failure or after msec without news
+int wait_child(const int startfd, const long msec) {
+	zmq_pollitem_t item = {NULL, startfd, ZMQ_POLLIN, 0};
+	uint64_t ready;
+	int rc;
+	
+	while(pstate >= 0) {
+		rc = zmq_poll(&item, 1, msec);
+		if(rc < 0 && errno == EINTR) continue;
+		if(rc <= 0) break;
+		if(read(startfd, &ready, sizeof(ready)) < 0) break;
+		return 0;
+	}
+	return -1;
+}
+
+//start/stop request to device write latency (us) after a F_RUN change, 0 if no client asked for it (pause and resume)
+uint32_t run_latency(struct Silshared *buf, uint64_t *last) {
+	struct timespec ts;
+	uint64_t cmd = __atomic_load_n(&(buf->runcmd), __ATOMIC_RELAXED);
+	
+	if(cmd == *last) return 0;
+	*last = cmd;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000L + (uint64_t)ts.tv_nsec - cmd) / 1000);
+}
+
+//real-time profile of a server process (see SilServ.cfg), then what the kernel actually granted
+void rt_setup(const char *who, const int cpu, const int prio, const int lock) {
+	cpu_set_t set;
+	struct sched_param sp;
+	char line[200], cpus[200] = "";
+	long kb = -1;
+	int i, len = 0;
+	FILE *f;
+	
+	if(cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(sched_setaffinity(0, sizeof(set), &set)) printf(YEL "%s" NRM ": CPU %d not granted (%s)\n", who, cpu, strerror(errno));
+	}
+	if(prio > 0) {
+		sp.sched_priority = prio;
+		if(sched_setscheduler(0, SCHED_FIFO, &sp)) printf(YEL "%s" NRM ": SCHED_FIFO priority %d not granted (%s)\n", who, prio, strerror(errno));
+	}
+	if(lock && mlockall(MCL_CURRENT | MCL_FUTURE)) printf(YEL "%s" NRM ": memory not locked (%s)\n", who, strerror(errno));
+	if(cpu < 0 && prio <= 0 && lock == 0) return;
+	
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for(i=0; i<CPU_SETSIZE && len < (int)sizeof(cpus) - 8; i++) {
+			if(CPU_ISSET(i, &set)) len += snprintf(cpus + len, sizeof(cpus) - len, "%s%d", len ? "," : "", i);
+		}
+	}
+	if((f = fopen("/proc/self/status", "r"))) {
+		while(fgets(line, sizeof(line), f)) {
+			if(sscanf(line, "VmLck: %ld", &kb) == 1) break;
+		}
+		fclose(f);
+	}
+	sp.sched_priority = 0;
+	sched_getparam(0, &sp);
+	printf(BLD "%s" NRM ": %s priority %d, CPU %s, %ld kB locked\n", who, (sched_getscheduler(0) == SCHED_FIFO) ? "SCHED_FIFO" : "time-shared", sp.sched_priority, cpus, kb);
+}
+
+//adaptive read scheduling of the device reader
+struct sched {
+	double rate;     // event rate estimate (Hz, moving average)
+	uint64_t events; // events read in the current window
+	uint64_t tlast;  // start of the current window (ms)
+	struct Silwatermark wm; // device watermark
+	long interval;   // read interval without watermark support (ms)
+};
+
+//every 100 ms: the device wakes the reader when rate x latency events are ready (a single one at low rates,
+//where waiting is pure latency; at most SIZE/4 and half of the free ring, so that a read always fits)
+//or when the oldest one has waited latency us; returns 1 if the watermark has to be set again
+int sched_update(struct sched *sc, const uint64_t msec, const uint32_t nfree, const int latency) {
+	double dt = (double)(msec - sc->tlast) / 1000.;
+	uint32_t events, limit = (nfree / 2 < SIZE / 4) ? nfree / 2 : SIZE / 4, diff;
+	
+	if(dt < 0.1) return 0;
+	sc->rate   = 0.7 * sc->rate + 0.3 * (double)sc->events / dt;
+	sc->events = 0;
+	sc->tlast  = msec;
+	
+	events = (uint32_t)(sc->rate * (double)latency * 1e-6);
+	if(events > limit) events = limit;
+	if(events < 1) events = 1;
+	
+	//without watermark support: polling often enough that SIZE/4 events never pile up
+	sc->interval = latency / 1000;
+	if(sc->rate > 0 && (long)(250. * SIZE / sc->rate) < sc->interval) sc->interval = (long)(250. * SIZE / sc->rate);
+	if(sc->interval < 1) sc->interval = 1;
+	
+	//changes below 25% are not worth an ioctl
+	diff = (events > sc->wm.events) ? events - sc->wm.events : sc->wm.events - events;
+	if(4 * diff <= sc->wm.events && sc->wm.timeout == (uint32_t)latency) return 0;
+	sc->wm.events  = events;
+	sc->wm.timeout = (uint32_t)latency;
+	return 1;
+}
+
+//the 0MQ server wakes up the device reader when flags change, the reader wakes up the streamer with new events
+void wake(const int wakefd) {
+	uint64_t one = 1;
+	if(write(wakefd, &one, sizeof(one)) < 0) perror(RED "wake" NRM);
+}
+
+//the device reader paused the acquisition only because the shared ring was full: it restarts once the ring is read
+void resume(struct Silshared *buf, const int wakefd) {
+	if(__atomic_load_n(&(buf->flags), __ATOMIC_ACQUIRE) & F_PAUSE) {
+		shm_flags(buf, F_RUN, F_PAUSE);
+		wake(wakefd);
+	}
+}
+
+//copies the unread events of consumer id straight from the shared ring into a new message, returns the number of events
+//(SIZE at most, clients receive in SIZE events buffers: a spooled backlog takes several messages)
+//the cursor does not move: events stay in the ring until shm_ack(buf, id, *from + count)
+uint32_t shm_msg(struct Silshared *buf, const int id, zmq_msg_t *msg, uint64_t *from) {
+	uint32_t count, n;
+	zmq_msg_t part;
+	
+	for(;;) {
+		count = shm_count(buf, id);
+		if(count > SIZE) count = SIZE;
+		zmq_msg_init_size(msg, count * sizeof(struct Silevent));
+		n = shm_peek(buf, id, zmq_msg_data(msg), count, from);
+		if(n == count) return n;
+		if(n == 0) {
+			//events dropped by the reader during the copy (DROP policy): trying again
+			zmq_msg_close(msg);
+			continue;
+		}
+		//the reader moved the cursor before the copy: fewer events than expected
+		zmq_msg_init_size(&part, n * sizeof(struct Silevent));
+		memcpy(zmq_msg_data(&part), zmq_msg_data(msg), n * sizeof(struct Silevent));
+		zmq_msg_close(msg);
+		zmq_msg_move(msg, &part);
+		return n;
+	}
+}
+
+//packed copy of a message of events (see SilCodec.c), the original one is closed
+void msg_pack(zmq_msg_t *msg) {
+	static uint8_t packed[SILPI_CODEC_BOUND(SIZE)];
+	size_t size = codec_encode(zmq_msg_data(msg), (uint32_t)(zmq_msg_size(msg) / sizeof(struct Silevent)), packed);
+	
+	zmq_msg_close(msg);
+	zmq_msg_init_size(msg, size);
+	memcpy(zmq_msg_data(msg), packed, size);
+}
+
+//0MQ server counters, exported together with the reader ones (struct Silstats) by metrics_text
+#define MET_CMDS 11
+#define MET_LAT  9
+#define MET_BAT  7
+static const char *met_cmds[MET_CMDS] = {"start", "stop", "policy", "codec", "stat", "check", "send", "get", "metrics", "spec", "other"};
+static const double met_lat[MET_LAT] = {1e-5, 3e-5, 1e-4, 3e-4, 1e-3, 3e-3, 1e-2, 3e-2, 1e-1}; // service time buckets (s)
+static const uint32_t met_bat[MET_BAT] = {0, 10, 100, 1000, 2500, 5000, SIZE};         // batch size buckets (events)
+
+struct servstats {
+	uint64_t bytes;                      // event batches sent, headers included (replies and streaming socket)
+	uint64_t lat[MET_CMDS][MET_LAT + 1]; // requests by service time bucket (the last one: slower)
+	double latsum[MET_CMDS];             // total service time (s)
+	uint64_t bat[MET_BAT + 1];           // batches by size bucket
+	uint64_t batsum;                     // events in the batches
+};
+
+//index of the request in the service time histogram
+int met_cmd(const char *cmd) {
+	int i;
+	
+	if(strcmp(cmd, "block") == 0 || strcmp(cmd, "drop") == 0) return 2;
+	if(strncmp(cmd, "get", 3) == 0) return 7;
+	if(strncmp(cmd, "spec", 4) == 0) return 9;
+	for(i=0; i<MET_CMDS-1; i++) {
+		if(strcmp(cmd, met_cmds[i]) == 0) return i;
+	}
+	return MET_CMDS - 1;
+}
+
+//request cmd served, received at t0 (CLOCK_MONOTONIC)
+void met_request(struct servstats *met, const int cmd, const struct timespec *t0) {
+	struct timespec t1;
+	double dt;
+	int i;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	dt = (double)(t1.tv_sec - t0->tv_sec) + 1e-9 * (double)(t1.tv_nsec - t0->tv_nsec);
+	for(i=0; i<MET_LAT && dt > met_lat[i]; i++);
+	met->lat[cmd][i]++;
+	met->latsum[cmd] += dt;
+}
+
+//batch of count events sent in bytes
+void met_batch(struct servstats *met, const uint32_t count, const size_t bytes) {
+	int i;
+	
+	for(i=0; i<MET_BAT && count > met_bat[i]; i++);
+	met->bat[i]++;
+	met->batsum += count;
+	met->bytes  += bytes;
+}
+
+//header of a batch of count events from stream position from (msg: events, raw or packed)
+//with the server status: a single round trip gives data, flags and backlog
+void batch_fill(struct Silbatch *batch, struct Silshared *buf, const uint64_t from, const uint32_t count, zmq_msg_t *msg) {
+	struct timespec now;
+	uint64_t head = __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE);
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	batch->first = from;
+	batch->time  = (uint64_t)now.tv_sec * 1000000000L + (uint64_t)now.tv_nsec;
+	batch->count = count;
+	batch->flags = __atomic_load_n(&(buf->flags), __ATOMIC_ACQUIRE);
+	batch->size  = (uint32_t)zmq_msg_size(msg);
+	batch->backlog = (head > from + count) ? (uint32_t)(head - from - count) : 0;
+	batch->occ   = shm_used(buf);
+}
+
+//sends every event of consumer id on the streaming socket, in batches with a Silbatch header
+//returns 1 if the socket is full (PUSH without ready clients), 0 when the ring is empty, -1 on error
+int stream_flush(void *stream, struct Silshared *buf, const int id, struct Silbatch *batch, struct servstats *met) {
+	zmq_msg_t msg;
+	uint64_t from;
+	uint32_t count;
+	int events;
+	size_t len = sizeof(events);
+	
+	while(shm_count(buf, id) > 0) {
+		//events leave the ring only when the socket can take a message
+		if(zmq_getsockopt(stream, ZMQ_EVENTS, &events, &len)) return -1;
+		if((events & ZMQ_POLLOUT) == 0) return 1;
+		
+		count = shm_msg(buf, id, &msg, &from);
+		shm_ack(buf, id, from + count);
+		if(batch->codec == SILPI_CODEC_PACK) msg_pack(&msg);
+		batch_fill(batch, buf, from, count, &msg);
+		if(zmq_send(stream, batch, sizeof(struct Silbatch), ZMQ_SNDMORE|ZMQ_DONTWAIT) < 0 || zmq_msg_send(&msg, stream, 0) < 0) {
+			zmq_msg_close(&msg);
+			return -1;
+		}
+		batch->seq++;
+		met_batch(met, count, sizeof(struct Silbatch) + batch->size);
+	}
+	return 0;
+}
+
+//REQ clients reach the ROUTER socket of the 0MQ server with their own routing id:
+//each one gets a cursor in the shared ring and reads the whole stream at its own pace
+struct client {
+	uint8_t id[256]; // 0MQ routing id (idlen = 0 for a free entry)
+	size_t idlen;
+	int cons;        // cursor in the shared ring (-1 until "start" or the first data request)
+	int run;         // the client started the acquisition
+	int codec;       // encoding of the "send" and "get" replies (SILPI_CODEC_RAW or SILPI_CODEC_PACK)
+	uint64_t seq;    // "get" replies sent
+	time_t last;     // last request
+};
+
+//the acquisition runs while at least one client wants it
+void run_update(struct Silshared *buf, struct client *clients, const int wakefd) {
+	int i, run = 0;
+	struct timespec ts;
+	
+	for(i=0; i<SILPI_MAXCONS; i++) {
+		if(clients[i].idlen && clients[i].run) run = 1;
+	}
+	//request time for the latency measured by the reader (see run_latency)
+	if(run != ((__atomic_load_n(&(buf->flags), __ATOMIC_RELAXED) & F_RUN) != 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		__atomic_store_n(&(buf->runcmd), (uint64_t)ts.tv_sec * 1000000000L + (uint64_t)ts.tv_nsec, __ATOMIC_RELAXED);
+	}
+	if(run) shm_flags(buf, F_RUN, 0);
+	else shm_flags(buf, 0, F_RUN|F_PAUSE);
+	wake(wakefd);
+}
+
+//client sending the request (NULL if the table is full)
+struct client *client_get(struct client *clients, const uint8_t *id, const size_t idlen) {
+	struct client *cl, *freecl = NULL;
+	
+	for(cl = clients; cl < clients + SILPI_MAXCONS; cl++) {
+		if(cl->idlen == idlen && memcmp(cl->id, id, idlen) == 0) break;
+		if(cl->idlen == 0 && freecl == NULL) freecl = cl;
+	}
+	if(cl == clients + SILPI_MAXCONS) {
+		if(freecl == NULL) return NULL;
+		cl = freecl;
+		memcpy(cl->id, id, idlen);
+		cl->idlen = idlen;
+		cl->cons  = -1;
+		cl->run   = 0;
+		cl->codec = SILPI_CODEC_RAW;
+		cl->seq   = 0;
+	}
+	cl->last = time(NULL);
+	return cl;
+}
+
+//cursor of the client, taken at the current head on "start" or on the first data request
+//(clients of the streaming socket never get one), -1 if none is free
+int client_cursor(struct Silshared *buf, struct client *cl, const int policy) {
+	if(cl->cons < 0) {
+		cl->cons = shm_attach(buf, policy);
+		if(cl->cons < 0) printf(UP YEL " child" NRM ": too many clients reading, request refused\n\n");
+		else printf(UP GRN " child" NRM ": new client reading (cursor %d)\n\n", cl->cons);
+	}
+	return cl->cons;
+}
+
+//clients silent for more than idle seconds are gone: their cursors no longer hold the ring
+//returns 1 if one of them had started the acquisition
+int client_expire(struct Silshared *buf, struct client *clients, const int idle) {
+	struct client *cl;
+	time_t now = time(NULL);
+	int run = 0;
+	
+	for(cl = clients; cl < clients + SILPI_MAXCONS; cl++) {
+		if(cl->idlen == 0 || now - cl->last <= idle) continue;
+		printf(UP YEL " child" NRM ": client released after %d s without requests\n\n", idle);
+		if(cl->cons >= 0) shm_detach(buf, cl->cons);
+		if(cl->run) run = 1;
+		cl->idlen = 0;
+	}
+	return run;
+}
+
+//reply to a REQ client: routing id, empty delimiter, then the message
+int reply(void *responder, const uint8_t *id, const size_t idlen, const void *data, const size_t size) {
+	if(zmq_send(responder, id, idlen, ZMQ_SNDMORE) < 0 || zmq_send(responder, "", 0, ZMQ_SNDMORE) < 0) return -1;
+	return zmq_send(responder, data, size, 0);
+}
+
+//appends to the text of metrics_text (truncated at size)
+void met_put(char *out, const size_t size, size_t *len, const char *fmt, ...) {
+	va_list ap;
+	int n;
+	
+	if(*len + 1 >= size) return;
+	va_start(ap, fmt);
+	n = vsnprintf(out + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if(n > 0) *len = (*len + (size_t)n < size) ? *len + (size_t)n : size - 1;
+}
+
+//metric header and single value
+void met_one(char *out, const size_t size, size_t *len, const char *name, const char *type, const char *help, const int adc, const double val) {
+	met_put(out, size, len, "# HELP %s %s\n# TYPE %s %s\n%s{adc=\"%d\"} %.17g\n", name, help, name, type, name, adc, val);
+}
+
+//Prometheus text format of every counter (for central scraping of several Pis), returns its length
+size_t metrics_text(char *out, const size_t size, struct Silshared *buf, const struct servstats *met, const struct client *clients, const int adc) {
+	int i, j, flags = __atomic_load_n(&(buf->flags), __ATOMIC_ACQUIRE), ncl = 0;
+	uint64_t dropped = 0, cum;
+	size_t len = 0;
+	struct timespec cpu;
+	
+	for(i=0; i<SILPI_MAXCONS; i++) {
+		if(__atomic_load_n(&(buf->cons[i].policy), __ATOMIC_ACQUIRE)) dropped += __atomic_load_n(&(buf->cons[i].dropped), __ATOMIC_RELAXED);
+		if(clients[i].idlen) ncl++;
+	}
+	out[0] = '\0';
+	met_one(out, size, &len, "silpi_events_read_total", "counter", "Events read from the device.", adc, (double)__atomic_load_n(&(buf->stats.events), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_read_rate_hz", "gauge", "Events read in the last second.", adc, (double)__atomic_load_n(&(buf->stats.rate), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_sent_bytes_total", "counter", "Event batches sent to clients, headers included.", adc, (double)met->bytes);
+	met_one(out, size, &len, "silpi_ring_size", "gauge", "Capacity of the shared ring (events).", adc, SIZE);
+	met_one(out, size, &len, "silpi_ring_occupancy", "gauge", "Events held in the shared ring.", adc, (double)__atomic_load_n(&(buf->stats.occ), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_ring_occupancy_max", "gauge", "Highest occupancy of the shared ring since start.", adc, (double)__atomic_load_n(&(buf->stats.occmax), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_pauses_total", "counter", "Acquisition pauses because of a full ring.", adc, (double)__atomic_load_n(&(buf->stats.pauses), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_paused_seconds_total", "counter", "Time with the acquisition paused by a full ring (ended pauses).", adc, 1e-9 * (double)__atomic_load_n(&(buf->stats.paused), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_spooled_events_total", "counter", "Events moved to the spool file.", adc, (double)__atomic_load_n(&(buf->stats.spooled), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_dropped_events_total", "counter", "Events skipped by slow DROP clients.", adc, (double)dropped);
+	met_one(out, size, &len, "silpi_clients", "gauge", "REQ clients known to the server.", adc, ncl);
+	met_one(out, size, &len, "silpi_running", "gauge", "Acquisition running.", adc, (flags & F_RUN) ? 1 : 0);
+	met_one(out, size, &len, "silpi_paused", "gauge", "Acquisition paused by a full ring.", adc, (flags & F_PAUSE) ? 1 : 0);
+	met_one(out, size, &len, "silpi_run_latency_seconds", "gauge", "Last start/stop request to ADC gate latency.", adc, 1e-6 * (double)__atomic_load_n(&(buf->stats.runlat), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_run_latency_max_seconds", "gauge", "Highest start/stop request to ADC gate latency.", adc, 1e-6 * (double)__atomic_load_n(&(buf->stats.runlatmax), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_latency_target_seconds", "gauge", "Read latency target (latency in SilServ.cfg).", adc, 1e-6 * (double)__atomic_load_n(&(buf->stats.latency), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_sched_batch_events", "gauge", "Events ready before the device wakes the reader.", adc, (double)__atomic_load_n(&(buf->stats.wm_events), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_sched_timeout_seconds", "gauge", "Longest wait of a ready event before the reader is woken.", adc, 1e-6 * (double)__atomic_load_n(&(buf->stats.wm_timeout), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_sched_interval_seconds", "gauge", "Read interval without watermark support in the device.", adc, 1e-3 * (double)__atomic_load_n(&(buf->stats.interval), __ATOMIC_RELAXED));
+	met_one(out, size, &len, "silpi_sched_retunes_total", "counter", "Watermark changes of the read scheduler.", adc, (double)__atomic_load_n(&(buf->stats.retunes), __ATOMIC_RELAXED));
+	
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	met_put(out, size, &len, "# HELP silpi_cpu_seconds_total CPU time of the SilServ processes.\n# TYPE silpi_cpu_seconds_total counter\n");
+	met_put(out, size, &len, "silpi_cpu_seconds_total{adc=\"%d\",process=\"reader\"} %.9f\n", adc, 1e-9 * (double)__atomic_load_n(&(buf->stats.cpu), __ATOMIC_RELAXED));
+	met_put(out, size, &len, "silpi_cpu_seconds_total{adc=\"%d\",process=\"server\"} %.9f\n", adc, (double)cpu.tv_sec + 1e-9 * (double)cpu.tv_nsec);
+	
+	//histograms: cumulative buckets (percentiles with histogram_quantile)
+	met_put(out, size, &len, "# HELP silpi_request_duration_seconds Service time of the REQ/REP requests.\n# TYPE silpi_request_duration_seconds histogram\n");
+	for(i=0; i<MET_CMDS; i++) {
+		for(j=0, cum=0; j<=MET_LAT; j++) {
+			cum += met->lat[i][j];
+			if(j < MET_LAT) met_put(out, size, &len, "silpi_request_duration_seconds_bucket{adc=\"%d\",cmd=\"%s\",le=\"%g\"} %lu\n", adc, met_cmds[i], met_lat[j], (unsigned long)cum);
+			else met_put(out, size, &len, "silpi_request_duration_seconds_bucket{adc=\"%d\",cmd=\"%s\",le=\"+Inf\"} %lu\n", adc, met_cmds[i], (unsigned long)cum);
+		}
+		met_put(out, size, &len, "silpi_request_duration_seconds_sum{adc=\"%d\",cmd=\"%s\"} %.9f\n", adc, met_cmds[i], met->latsum[i]);
+		met_put(out, size, &len, "silpi_request_duration_seconds_count{adc=\"%d\",cmd=\"%s\"} %lu\n", adc, met_cmds[i], (unsigned long)cum);
+	}
+	met_put(out, size, &len, "# HELP silpi_batch_events Events in each batch sent.\n# TYPE silpi_batch_events histogram\n");
+	for(j=0, cum=0; j<=MET_BAT; j++) {
+		cum += met->bat[j];
+		if(j < MET_BAT) met_put(out, size, &len, "silpi_batch_events_bucket{adc=\"%d\",le=\"%u\"} %lu\n", adc, met_bat[j], (unsigned long)cum);
+		else met_put(out, size, &len, "silpi_batch_events_bucket{adc=\"%d\",le=\"+Inf\"} %lu\n", adc, (unsigned long)cum);
+	}
+	met_put(out, size, &len, "silpi_batch_events_sum{adc=\"%d\"} %lu\n", adc, (unsigned long)met->batsum);
+	met_put(out, size, &len, "silpi_batch_events_count{adc=\"%d\"} %lu\n", adc, (unsigned long)cum);
+	return len;
+}
+
+//reply to "spec <version>": totals and bins changed after version (all bins since the last clear if that came later)
+int spec_reply(void *responder, const uint8_t *id, const size_t idlen, struct Silshared *buf, const uint64_t since, const int adc) {
+	static struct Silspecbin bins[SILPI_SPEC_BINS];
+	struct Silspecshm *sp = &(buf->specs);
+	struct Silspecdelta head = {SILPI_SPEC_MAGIC, SILPI_REC_VERSION, (uint16_t)adc, 0, 0, 0, 0, 0, 0, 0, 0};
+	uint64_t reset;
+	uint32_t bin, thr, count = 0;
+	
+	//bins of every version up to this one are complete, later changes are sent again next time
+	head.version = __atomic_load_n(&(sp->version), __ATOMIC_ACQUIRE);
+	reset = __atomic_load_n(&(sp->reset), __ATOMIC_RELAXED);
+	head.full = (since < reset);
+	thr = (uint32_t)(head.full ? reset - 1 : since);
+	for(bin = 0; bin < SILPI_SPEC_BINS; bin++) {
+		//(32 bit versions, compared modulo 2^32)
+		if((int32_t)(__atomic_load_n(&(sp->ver[bin]), __ATOMIC_RELAXED) - thr) <= 0) continue;
+		bins[count].bin   = bin;
+		bins[count].count = __atomic_load_n(&(sp->spec.bins[bin]), __ATOMIC_RELAXED);
+		count++;
+	}
+	head.count  = count;
+	head.events = __atomic_load_n(&(sp->spec.events), __ATOMIC_RELAXED);
+	head.errors = __atomic_load_n(&(sp->spec.errors), __ATOMIC_RELAXED);
+	head.tstart = __atomic_load_n(&(sp->spec.tstart), __ATOMIC_RELAXED);
+	head.tstop  = __atomic_load_n(&(sp->spec.tstop), __ATOMIC_RELAXED);
+	head.dead   = __atomic_load_n(&(sp->spec.dead), __ATOMIC_RELAXED);
+	
+	if(zmq_send(responder, id, idlen, ZMQ_SNDMORE) < 0 || zmq_send(responder, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(responder, &head, sizeof(head), ZMQ_SNDMORE) < 0) return -1;
+	return zmq_send(responder, bins, count * sizeof(struct Silspecbin), 0);
+}
+
+//Prometheus scrape on the metrics port: the 0MQ STREAM socket speaks plain TCP,
+//any HTTP request gets the metrics, then the connection is closed
+void metrics_http(void *sock, struct Silshared *buf, const struct servstats *met, const struct client *clients, const int adc) {
+	static char text[32768];
+	char req[2048], head[200];
+	uint8_t id[256];
+	size_t idlen, len;
+	int n;
+	
+	n = zmq_recv(sock, id, sizeof(id), ZMQ_DONTWAIT);
+	if(n < 0) return;
+	idlen = (size_t)n;
+	n = zmq_recv(sock, req, sizeof(req), 0);
+	if(n < 4 || strncmp(req, "GET ", 4)) return; //connection opened or closed (empty frame), rest of a request
+	
+	len = metrics_text(text, sizeof(text), buf, met, clients, adc);
+	n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)len);
+	zmq_send(sock, id, idlen, ZMQ_SNDMORE);
+	zmq_send(sock, head, (size_t)n, 0);
+	zmq_send(sock, id, idlen, ZMQ_SNDMORE);
+	zmq_send(sock, text, len, 0);
+	zmq_send(sock, id, idlen, ZMQ_SNDMORE);
+	zmq_send(sock, "", 0, 0);
+}
+
 void childsig(int num) {
 	switch(num) {
-		case SIGUSR1: if(cstate>=0) cstate++; break;
 		case SIGUSR2: cstate=-1; break;
 		case SIGINT: cstate=-1; printf("***** CHILD SIGINT CATCHED *****\n\n");
 	}
 }
 
-int main() {
+int main(int argc, char *argv[]) {
 	struct Silshared *buf;
+	char devname[100] = "/dev/silena", memname[100] = "/silsrvsh", endpoint[100], cfgname[100] = "SilServ.cfg", spoolname[600];
+	int adc = 0, port = 4747;
+	struct servcfg cfg;
+	
+	//one server for each ADC: ADC n uses /dev/silena<n> and port 4747 + n
+	if(argc > 1) adc = atoi(argv[1]);
+	if(argc > 2) snprintf(cfgname, sizeof(cfgname), "%s", argv[2]);
+	if(adc < 0) adc = 0;
+	if(adc > 0) {
+		sprintf(devname, "/dev/silena%d", adc);
+		sprintf(memname, "/silsrvsh%d", adc);
+		port += adc;
+	}
+	sprintf(endpoint, "tcp://*:%d", port);
+	read_config(cfgname, &cfg, port, adc);
 	
 	printf(GRN "***** Silena - Raspberry Pi interface - event dispatcher *****\n" NRM);
+	printf(BLD "  main" NRM ": serving %s on port %d\n", devname, port);
+	int wakefd = eventfd(0, EFD_NONBLOCK), datafd = eventfd(0, EFD_NONBLOCK), recfd = eventfd(0, EFD_NONBLOCK), startfd = eventfd(0, EFD_NONBLOCK);
+	if(wakefd < 0 || datafd < 0 || recfd < 0 || startfd < 0) {
+		perror(RED "eventfd" NRM);
+		exit(EXIT_FAILURE);
+	}
+	//spool file for the events of slow clients, shared by the processes forked below
+	int spoolfd = -1;
+	if(cfg.spool[0]) {
+		snprintf(spoolname, sizeof(spoolname), "%s/silpi%d.spool", cfg.spool, adc);
+		spoolfd = open(spoolname, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if(spoolfd < 0) {
+			perror(YEL "  main" NRM);
+			printf(YEL "  main" NRM ": no spool, slow clients will pause the acquisition\n");
+		}
+		else printf(BLD "  main" NRM ": spooling to %s\n", spoolname);
+		shm_spool(spoolfd);
+	}
+	//shared memory mapped before the forks: every process finds it ready, no handshake needed
+	struct timespec tstart, tready;
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
+	buf = shm_request(memname, 1, cfg.huge);
+	if(buf == NULL) exit(EXIT_FAILURE);
+	memset(buf, 0, offsetof(struct Silshared, buffer)); //no consumers yet
+	//handlers before the fork: the child may report a failure right away (it installs its own ones at once)
+	signal(SIGUSR2, parsig);
+	signal(SIGINT, parsig);
 	pid_t pid = fork();
 	if(pid < 0) {
 		perror(RED "fork" NRM);
+		shm_release(buf, memname, 1);
 		exit(EXIT_FAILURE);
 	}
 	if(pid) {
 		//parent process, pid = child pid
 		//event reading from device
 		printf(BLD "parent" NRM ": PID = %d,  child PID = %d\n", getpid(), pid);
-		signal(SIGUSR1, parsig);
-		signal(SIGUSR2, parsig);
-		signal(SIGINT, parsig);
-		printf(BLD "parent" NRM ": signals registered, requesting shared memory.\n");
-		sleep(1);
-		buf = shm_request("/silsrvsh", 1);
-		if(buf == NULL) {
-			kill(pid, SIGUSR2);
-			exit(EXIT_FAILURE);
+		
+		//optional recorder: a third process, sharing the ring mapping
+		pid_t recpid = 0;
+		if(cfg.rec.dir[0]) {
+			recpid = fork();
+			if(recpid == 0) exit(rec_run(buf, &(cfg.rec), recfd) ? EXIT_FAILURE : 0);
+			if(recpid < 0) {
+				perror(YEL "parent" NRM);
+				recpid = 0;
+			}
 		}
-		kill(pid, SIGUSR1);
-		buf->size = 0;
-		buf->flags = 0;
 		
-		printf(BLD "parent" NRM ": shared memory allocated, waiting for child process...\n");
-		sleep(5);
-		if(pstate != 1) {
+		int fd = open(devname, O_RDWR|O_NONBLOCK);
+		if(fd < 0) {
+			perror(RED "parent" NRM);
 			kill(pid, SIGUSR2);
-			shm_release(buf, "/silsrvsh", 1);
+			if(recpid) kill(recpid, SIGUSR2);
+			shm_release(buf, memname, 1);
 			exit(EXIT_FAILURE);
 		}
+		struct Silring *ring = dev_map(fd);
+		if(ring == NULL) printf(YEL "parent" NRM ": event ring not mapped, falling back to read()\n");
+		//after the recorder fork: disk writes stay time-shared
+		rt_setup("parent", cfg.cpu_reader, cfg.rt_prio, cfg.mlock);
 		
-		int fd = open("/dev/silena", O_RDWR);
-		if(fd < 0) {
-			perror(RED "parent" NRM);
+		if(wait_child(startfd, 5000)) {
+			printf(RED "parent" NRM ": 0MQ server not started\n");
 			kill(pid, SIGUSR2);
-			shm_release(buf, "/silsrvsh", 1);
+			if(recpid) kill(recpid, SIGUSR2);
+			if(ring) dev_unmap(ring);
+			close(fd);
+			shm_release(buf, memname, 1);
 			exit(EXIT_FAILURE);
 		}
+		clock_gettime(CLOCK_MONOTONIC, &tready);
+		printf(BLD "parent" NRM ": server ready in %.1f ms\n", 1e3 * (double)(tready.tv_sec - tstart.tv_sec) + 1e-6 * (double)(tready.tv_nsec - tstart.tv_nsec));
 		
 		const char off[2] = "0", on[2] = "1";
 		struct timeval t0, ti, td;
-		uint64_t N = 0, usec, msec, lastmsec = 0;
+		uint64_t N = 0, S = 0, usec, msec, lastmsec = 0, tpause = 0, pend = 0;
+		struct Silstats st;
+		struct timespec cpu;
+		memset(&st, 0, sizeof(st));
 		ssize_t n;
-		struct Silevent buffer[SIZE];
-		int runflag = 0;
+		int runflag = 0, flags, nitems;
+		long timeout = 1000;
+		uint64_t wakes, runcmd = 0;
+		uint32_t lat;
+		
+		//the device is readable when enough events are ready or the oldest one has waited the latency target
+		//(the watermark follows the event rate, see sched_update), without watermark support it is polled
+		struct sched sc = {0, 0, 0, {1, (uint32_t)cfg.latency}, cfg.latency / 1000};
+		if(sc.interval < 1) sc.interval = 1;
+		int devpoll = (ioctl(fd, SILPI_IOC_WATERMARK, &(sc.wm)) == 0);
+		if(devpoll == 0) printf(YEL "parent" NRM ": no watermark support in the device, polling it\n");
+		st.latency = (uint32_t)cfg.latency;
+		zmq_pollitem_t items[2] = {{NULL, wakefd, ZMQ_POLLIN, 0}, {NULL, fd, ZMQ_POLLIN, 0}};
 		
-		usleep(10000);
 		printf("\n");
 		gettimeofday(&t0, NULL);
 		while(pstate >= 0) {
-			if(runflag) usleep(10000); // 10ms sleep between device readings
-			else sleep(1); //if acquisition is stopped wait more
+			//waiting for flag changes, events in the device or the next status update (signals interrupt the wait)
+			//the device is watched only while running with free slots in the shared ring
+			nitems = (runflag && devpoll && shm_free(buf)) ? 2 : 1;
+			if(runflag && devpoll == 0 && timeout > sc.interval) timeout = sc.interval;
+			if(zmq_poll(items, nitems, timeout) < 0 && errno != EINTR) {
+				perror(RED "parent" NRM);
+				break;
+			}
+			if(pstate < 0) break;
+			if(items[0].revents & ZMQ_POLLIN) {
+				if(read(wakefd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) perror(RED "parent" NRM);
+			}
 			
-			if(runflag) {
-				n = read(fd, buffer, sizeof(buffer));
-				if(n < 0 || pstate < 0) break;
-				
-				if(n % sizeof(struct Silevent)) {
-					printf(UP YEL "parent" NRM ": read fraction of event (size = %ld)\n\n", (long int)n);
+			//slow BLOCK clients: instead of pausing, their oldest events go to the spool (read back in order)
+			if(spoolfd >= 0) {
+				n = shm_spill(buf);
+				if(n < 0) {
+					printf(UP RED "parent" NRM ": spool write failed, slow clients will pause the acquisition\n\n");
+					shm_spool(-1);
+					spoolfd = -1;
+				}
+				else {
+					S += n;
+					st.spooled += n;
 				}
-				n /= sizeof(struct Silevent);
 			}
-			else n = 0;
 			
-			if(n > 0) {
-				while(buf->flags & F_RBUSY) usleep(1000);
-				buf->flags |= F_WBUSY;
-				if(buf->size + n >= SIZE) {
-					printf(UP YEL "parent" NRM ": full buffer, possible data loss\n\n");
-					buf->flags &= ~F_RUN;
-					buf->flags |=  F_PAUSE;
-					//TO DO: dead time calculation when acquisition is paused!!
-					//TO DO: recover missing data when acquisition is paused!!
-					n = SIZE - buf->size;
-				}
-				for(int i = 0; i < n; i++) buf->buffer[(buf->size)++] = buffer[i];
-				N += n;
-				buf->flags -= F_WBUSY;
+			//events go from the device straight into the shared ring
+			//only the ones that fit are taken, the others wait in the device
+			if(runflag && shm_free(buf) == 0) {
+				printf(UP YEL "parent" NRM ": full buffer (slow blocking client), pausing acquisition\n\n");
+				shm_flags(buf, F_PAUSE, F_RUN);
+				st.pauses++;
 			}
 			
-			if((buf->flags & F_RUN) == 0 && runflag == 1) {
-				printf(UP YEL "parent" NRM ": stopping acquisition\n\n");
-				if(write(fd, off, 2) < 0) {
-					perror(RED "write" NRM);
-					break;
+			if(runflag) {
+				n = dev_to_shm(fd, ring, buf);
+				if(n < 0 || pstate < 0) break;
+				shm_spectrum(buf, (uint32_t)n, pend);
+				pend = 0;
+				if(n > 0 && cfg.stream) wake(datafd);
+				if(n > 0 && recpid) wake(recfd);
+				if(n > 0) {
+					st.occ = shm_used(buf);
+					if(st.occ > st.occmax) st.occmax = st.occ;
 				}
-				runflag = 0;
-				fsync(fd);
+				sc.events += n;
+				N += n;
 			}
+			else shm_spectrum(buf, 0, 0); //clear requested while stopped
 			
-			if((buf->flags & F_RUN) && runflag == 0) {
-				printf(UP YEL "parent" NRM ": starting acquisition\n\n");
-				if(write(fd, on, 2) < 0) {
+			flags = __atomic_load_n(&(buf->flags), __ATOMIC_ACQUIRE);
+			if(((flags & F_RUN) != 0) != runflag) {
+				//the write sets the ADC gate: the request is applied here, at most one wakeup after the 0MQ server stored it
+				if(write(fd, runflag ? off : on, 2) < 0) {
 					perror(RED "write" NRM);
 					break;
 				}
-				buf->size = 0;
-				runflag = 1;
+				runflag = !runflag;
 				fsync(fd);
+				//paused: dead time from the ADC gate closed by the full ring to the gate open again
+				if(runflag == 0 && (flags & F_PAUSE)) tpause = raw_ns();
+				if(runflag && tpause) {
+					pend = raw_ns() - tpause;
+					st.paused += pend;
+					printf(UP YEL "parent" NRM ": %.3f ms of dead time while paused\n\n", 1e-6 * (double)pend);
+					tpause = 0;
+				}
+				if((lat = run_latency(buf, &runcmd))) {
+					st.runlat = lat;
+					if(lat > st.runlatmax) st.runlatmax = lat;
+					printf(UP YEL "parent" NRM ": %s acquisition (%.3f ms after the request)\n\n", runflag ? "starting" : "stopping", 1e-3 * lat);
+					stats_publish(buf, &st);
+				}
+				else printf(UP YEL "parent" NRM ": %s acquisition\n\n", runflag ? "starting" : "stopping");
 			}
+			//a stop during the pause ends it: only pause to resume intervals are dead time
+			if((flags & (F_RUN | F_PAUSE)) == 0) tpause = 0;
 			
 			gettimeofday(&ti, NULL);
 			timersub(&ti, &t0, &td);
 			usec = (uint64_t)td.tv_usec + 1000000L * (uint64_t)td.tv_sec;
 			msec = (usec + 500L) / 1000L;
+			if(runflag && sched_update(&sc, msec, shm_free(buf), cfg.latency)) {
+				if(devpoll && ioctl(fd, SILPI_IOC_WATERMARK, &(sc.wm))) perror(YEL "parent" NRM);
+				st.retunes++;
+			}
 			if(msec - lastmsec >= 1000) {
 				//status update every second
 				printf(UP BLD "parent" NRM ": uptime =%6lu s, status = %s, i-rate =%6.0lf Hz\n", (unsigned long)(msec / 1000L), runflag ? (GRN " RUN" NRM) : (RED "STOP" NRM), 1000. * ((double)N) / ((double)(msec - lastmsec)));
+				if(S) printf(UP YEL "parent" NRM ": %lu events spooled to disk for slow clients\n\n", (unsigned long)S);
+				//counters for the "metrics" request
+				st.events += N;
+				st.rate = (1000L * N) / (msec - lastmsec);
+				st.occ  = shm_used(buf);
+				clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+				st.cpu  = (uint64_t)cpu.tv_sec * 1000000000L + (uint64_t)cpu.tv_nsec;
+				st.wm_events  = sc.wm.events;
+				st.wm_timeout = sc.wm.timeout;
+				st.interval   = (uint32_t)sc.interval;
+				stats_publish(buf, &st);
 				N = 0;
+				S = 0;
 				lastmsec = msec;
 			}
+			timeout = 1000L - (long)(msec - lastmsec);
 		}
 		
 		printf(BLD "parent" NRM ": closing device and quitting acquisition\n");
 		kill(pid, SIGUSR2);
+		if(recpid) {
+			kill(recpid, SIGUSR2);
+			waitpid(recpid, NULL, 0);
+		}
 		if(write(fd, off, 2) < 0) perror("write");
-		fsync(fd); close(fd);
-		shm_release(buf, "/silsrvsh", 1);
+		if(ring) dev_unmap(ring);
+		fsync(fd); close(fd); close(wakefd); close(datafd); close(recfd); close(startfd);
+		if(cfg.spool[0]) unlink(spoolname);
+		shm_release(buf, memname, 1);
+		//the 0MQ server quits on SIGUSR2: its last messages come before the shell prompt
+		while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
 	}
 	else {
 		//child process, pid = parent pid
 		//communication with clients via 0MQ
-		pid = getppid();
-		printf(BLD " child" NRM ": PID = %d, parent PID = %d\n", getpid(), pid);
-		signal(SIGUSR1, childsig);
 		signal(SIGUSR2, childsig);
 		signal(SIGINT, childsig);
-		printf(BLD " child" NRM ": signals registered, waiting for shared memory creation.\n");
-		sleep(5);
-		if(cstate != 1) {
-			kill(pid, SIGUSR2);
-			exit(EXIT_FAILURE);
-		}
-		printf(BLD " child" NRM ": requesting shared memory\n");
-		buf = shm_request("/silsrvsh", 0);
-		if(buf == NULL) {
-			kill(pid, SIGUSR2);
-			exit(EXIT_FAILURE);
-		}
-		kill(pid, SIGUSR1);
+		if(pstate < 0) cstate = -1; //stopped before its own handlers
+		pid = getppid();
+		printf(BLD " child" NRM ": PID = %d, parent PID = %d\n", getpid(), pid);
 		
+		//before the 0MQ context: its I/O threads inherit CPU and locked memory
+		rt_setup(" child", cfg.cpu_net, 0, cfg.mlock);
 		void *context = zmq_ctx_new();
-		void *responder = zmq_socket(context, ZMQ_REP);
-		if(zmq_bind(responder, "tcp://*:4747")) {
+		void *responder = zmq_socket(context, ZMQ_ROUTER);
+		//a client reconnecting with its own identity (see "get") takes over the old connection
+		int handover = 1;
+		zmq_setsockopt(responder, ZMQ_ROUTER_HANDOVER, &handover, sizeof(handover));
+		if(zmq_bind(responder, endpoint)) {
 			zmq_close(responder);
 			zmq_ctx_destroy(context);
 			perror(RED " child" NRM);
-			shm_release(buf, "/silsrvsh", 0);
+			shm_release(buf, memname, 0);
 			kill(pid, SIGUSR2);
 			exit(EXIT_FAILURE);
 		}
-		printf(BLD " child" NRM ": 0MQ context and socket opened. Listening at port 4747...\n");
+		printf(BLD " child" NRM ": 0MQ context and socket opened. Listening at port %d...\n", port);
+		
+		//optional streaming socket: events are pushed as soon as the reader stores them
+		//PUSH holds the ring like a BLOCK client, PUB is a DROP one
+		void *stream = NULL;
+		int scons = -1;
+		if(cfg.stream) {
+			stream = zmq_socket(context, cfg.stream);
+			zmq_setsockopt(stream, ZMQ_SNDHWM, &(cfg.hwm), sizeof(cfg.hwm));
+			sprintf(endpoint, "tcp://*:%d", cfg.stream_port);
+			if(zmq_bind(stream, endpoint)) {
+				perror(YEL " child" NRM);
+				printf(YEL " child" NRM ": streaming disabled\n");
+				zmq_close(stream);
+				stream = NULL;
+			}
+			else {
+				printf(BLD " child" NRM ": streaming (%s) at port %d\n", cfg.stream == ZMQ_PUSH ? "PUSH" : "PUB", cfg.stream_port);
+				scons = shm_attach(buf, cfg.stream == ZMQ_PUSH ? SILPI_CONS_BLOCK : SILPI_CONS_DROP);
+			}
+		}
+		
+		//optional Prometheus endpoint (the same text of the "metrics" request, over HTTP)
+		void *metrics = NULL;
+		if(cfg.metrics) {
+			metrics = zmq_socket(context, ZMQ_STREAM);
+			sprintf(endpoint, "tcp://*:%d", cfg.metrics);
+			if(zmq_bind(metrics, endpoint)) {
+				perror(YEL " child" NRM);
+				printf(YEL " child" NRM ": metrics endpoint disabled\n");
+				zmq_close(metrics);
+				metrics = NULL;
+			}
+			else printf(BLD " child" NRM ": metrics at http://*:%d/metrics\n", cfg.metrics);
+		}
 		
 		ssize_t n;
-		char buffer[10];
+		char buffer[32];
+		static char text[32768];
+		int i, flags, first, nitems, pending = 0, more, cmd = -1;
+		struct servstats met;
+		struct timespec treq;
+		memset(&met, 0, sizeof(met));
+		size_t idlen, len;
+		uint8_t id[256];
+		uint64_t wakes, from;
+		uint32_t count;
+		zmq_msg_t msg;
+		struct client clients[SILPI_MAXCONS], *cl;
+		memset(clients, 0, sizeof(clients));
+		struct Silbatch batch = {SILPI_BATCH_MAGIC, SILPI_REC_VERSION, (uint16_t)adc, 0, 0, 0, 0, 0, (uint32_t)cfg.codec, 0, 0, 0}, rbatch = batch;
+		zmq_pollitem_t items[4] = {{metrics, 0, ZMQ_POLLIN, 0}, {responder, 0, ZMQ_POLLIN, 0}, {NULL, datafd, ZMQ_POLLIN, 0}, {stream, 0, ZMQ_POLLOUT, 0}};
+		wake(startfd); //sockets bound: the reader can start
 		while(cstate >= 0) {
-			usleep(10000); //10 ms sleep between command polling
+			//service time of the last request (every request ends with continue)
+			if(cmd >= 0) met_request(&met, cmd, &treq);
+			cmd = -1;
 			
-			n = zmq_recv(responder, buffer, 10, ZMQ_DONTWAIT); //non blocking request
-			if(n < 0 && errno == EAGAIN) continue;
+			//waiting for a request, new events or room on the streaming socket (signals interrupt the wait)
+			//(every second at least, to release silent clients)
+			//the metrics socket is polled only if open, the streaming one only when full
+			first = metrics ? 0 : 1;
+			nitems = stream ? (pending ? 4 : 3) : 2;
+			for(i=0; i<4; i++) items[i].revents = 0;
+			if(zmq_poll(items + first, nitems - first, 1000) < 0) {
+				if(errno == EINTR) continue;
+				perror(RED " child" NRM);
+				break;
+			}
+			if(items[2].revents & ZMQ_POLLIN) {
+				if(read(datafd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) perror(RED " child" NRM);
+			}
+			if(items[2].revents || items[3].revents) {
+				pending = stream_flush(stream, buf, scons, &batch, &met);
+				if(pending < 0) {
+					perror(RED " child" NRM);
+					break;
+				}
+				if(pending == 0) resume(buf, wakefd);
+			}
+			if(items[0].revents & ZMQ_POLLIN) metrics_http(metrics, buf, &met, clients, adc);
+			if(client_expire(buf, clients, cfg.idle)) run_update(buf, clients, wakefd);
+			if((items[1].revents & ZMQ_POLLIN) == 0) continue;
 			
+			//request frames: routing id, empty delimiter, command
+			n = zmq_recv(responder, id, sizeof(id), ZMQ_DONTWAIT); //non blocking request
+			if(n < 0 && errno == EAGAIN) continue;
 			if(n < 0) {
 				perror(RED " child" NRM);
 				break;
 			}
-			else {
-				if(n >= 10) n = 9;
-				buffer[n]='\0';
+			idlen = (size_t)n;
+			do {
+				//the last frame is the command
+				n = zmq_recv(responder, buffer, sizeof(buffer), 0);
+				len = sizeof(more);
+				if(zmq_getsockopt(responder, ZMQ_RCVMORE, &more, &len)) more = 0;
+			} while(more && n >= 0);
+			if(n < 0) continue;
+			if(n >= (ssize_t)sizeof(buffer)) n = sizeof(buffer) - 1;
+			buffer[n]='\0';
+			clock_gettime(CLOCK_MONOTONIC, &treq);
+			cmd = met_cmd(buffer);
+			
+			cl = client_get(clients, id, idlen);
+			if(cl == NULL) {
+				printf(UP YEL " child" NRM ": too many clients, request refused\n\n");
+				reply(responder, id, idlen, "NAK", 4);
+				continue;
 			}
 			
 			if(strcmp(buffer, "stop") == 0) {
-				zmq_send(responder, "ACK", 4, 0);
+				reply(responder, id, idlen, "ACK", 4);
 				printf(UP GRN " child" NRM ": STOP received\n\n");
-				buf->flags &= ~F_RUN;
-				buf->flags &= ~F_PAUSE;
+				cl->run = 0;
+				run_update(buf, clients, wakefd);
 				continue;
 			}
 			
 			if(strcmp(buffer, "start") == 0) {
-				zmq_send(responder, "ACK", 4, 0);
+				//the cursor is taken here: the events of the run are kept from the start, not from the first data request
+				if(client_cursor(buf, cl, cfg.policy) < 0) {
+					reply(responder, id, idlen, "NAK", 4);
+					continue;
+				}
+				reply(responder, id, idlen, "ACK", 4);
 				printf(UP GRN " child" NRM ":  RUN received\n\n");
-				buf->flags |= F_RUN;
+				//events stored before the start are skipped by this client only
+				shm_flush(buf, cl->cons);
+				cl->run = 1;
+				run_update(buf, clients, wakefd);
+				continue;
+			}
+			
+			if(strcmp(buffer, "block") == 0 || strcmp(buffer, "drop") == 0) {
+				//consumer policy of this client (e.g. block for a recorder)
+				if(client_cursor(buf, cl, cfg.policy) < 0) {
+					reply(responder, id, idlen, "NAK", 4);
+					continue;
+				}
+				__atomic_store_n(&(buf->cons[cl->cons].policy), buffer[0] == 'b' ? SILPI_CONS_BLOCK : SILPI_CONS_DROP, __ATOMIC_RELEASE);
+				reply(responder, id, idlen, "ACK", 4);
+				continue;
+			}
+			
+			if(strcmp(buffer, "codec") == 0) {
+				//packed "send" replies for this client, for slow links
+				cl->codec = SILPI_CODEC_PACK;
+				reply(responder, id, idlen, "ACK", 4);
 				continue;
 			}
 			
 			if(strcmp(buffer, "stat") == 0) {
-				zmq_send(responder, &(buf->flags), sizeof(buf->flags), 0);
+				flags = __atomic_load_n(&(buf->flags), __ATOMIC_ACQUIRE);
+				reply(responder, id, idlen, &flags, sizeof(flags));
+				continue;
+			}
+			
+			if(strncmp(buffer, "spec", 4) == 0 && (buffer[4] == '\0' || buffer[4] == ' ')) {
+				//server-side spectrum, "spec <version>": only the bins changed since the version of the previous reply
+				spec_reply(responder, id, idlen, buf, buffer[4] ? strtoull(buffer + 5, NULL, 10) : 0, adc);
+				continue;
+			}
+			
+			if(strcmp(buffer, "specclear") == 0) {
+				//done by the reader at its next loop (clients see the "full" flag in the next reply)
+				__atomic_store_n(&(buf->specs.clear), 1, __ATOMIC_RELEASE);
+				wake(wakefd);
+				reply(responder, id, idlen, "ACK", 4);
+				continue;
+			}
+			
+			if(strcmp(buffer, "metrics") == 0) {
+				//Prometheus text format, see metrics_text
+				reply(responder, id, idlen, text, metrics_text(text, sizeof(text), buf, &met, clients, adc));
 				continue;
 			}
 			
 			if(strcmp(buffer, "check") == 0) {
-				zmq_send(responder, "ACK", 4, 0);
+				reply(responder, id, idlen, "ACK", 4);
 				continue;
 			}
 			
 			if(strcmp(buffer, "exit") == 0) {
-				zmq_send(responder, "ACK", 4, 0);
+				reply(responder, id, idlen, "ACK", 4);
 				break;
 			}
 			
 			if(strcmp(buffer, "send") == 0) {
-				while(buf->flags & F_WBUSY) usleep(1000);
-				buf->flags |= F_RBUSY;
-				zmq_send(responder, buf->buffer, buf->size * sizeof(struct Silevent), 0);
-				buf->size = 0;
-				if(buf->flags & F_PAUSE) {
-					buf->flags |=  F_RUN;
-					buf->flags &= ~F_PAUSE;
+				//events are copied straight from the shared ring into the message
+				//(no events if no cursor is free)
+				if(client_cursor(buf, cl, cfg.policy) < 0) {
+					reply(responder, id, idlen, "", 0);
+					continue;
 				}
-				buf->flags -= F_RBUSY;
+				//(a reply lost on the way is lost for good, see "get")
+				count = shm_msg(buf, cl->cons, &msg, &from);
+				shm_ack(buf, cl->cons, from + count);
+				if(cl->codec == SILPI_CODEC_PACK) msg_pack(&msg);
+				met_batch(&met, count, zmq_msg_size(&msg));
+				if(zmq_send(responder, id, idlen, ZMQ_SNDMORE) < 0 || zmq_send(responder, "", 0, ZMQ_SNDMORE) < 0 || zmq_msg_send(&msg, responder, 0) < 0) zmq_msg_close(&msg);
+				resume(buf, wakefd);
+				continue;
+			}
+			
+			if(strncmp(buffer, "get", 3) == 0 && (buffer[3] == '\0' || buffer[3] == ' ')) {
+				//sequenced batch, "get <pos>": events before stream position pos have been received and leave the ring,
+				//the following ones are sent until acknowledged (a lost or late reply is requested again with the same pos,
+				//also from a new socket with the same identity) -> Silbatch header, then the events
+				if(client_cursor(buf, cl, cfg.policy) < 0) {
+					reply(responder, id, idlen, "NAK", 4);
+					continue;
+				}
+				if(buffer[3]) shm_ack(buf, cl->cons, strtoull(buffer + 4, NULL, 10));
+				count = shm_msg(buf, cl->cons, &msg, &from);
+				if(cl->codec == SILPI_CODEC_PACK) msg_pack(&msg);
+				rbatch.seq   = cl->seq++;
+				rbatch.codec = (uint32_t)cl->codec;
+				batch_fill(&rbatch, buf, from, count, &msg);
+				met_batch(&met, count, sizeof(rbatch) + rbatch.size);
+				if(zmq_send(responder, id, idlen, ZMQ_SNDMORE) < 0 || zmq_send(responder, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(responder, &rbatch, sizeof(rbatch), ZMQ_SNDMORE) < 0 || zmq_msg_send(&msg, responder, 0) < 0) zmq_msg_close(&msg);
+				resume(buf, wakefd);
 				continue;
 			}
 			//unknown command
-			zmq_send(responder, "NAK", 4, 0);
+			reply(responder, id, idlen, "NAK", 4);
 		}
 		
-		shm_release(buf, "/silsrvsh", 0);
+		shm_release(buf, memname, 0);
 		printf(GRN " child" NRM ": quitting acquisition and closing 0MQ server\n");
+		//replies and batches still queued are dropped: the reader waits for this process to quit
+		int linger = 0;
+		if(stream) {
+			zmq_setsockopt(stream, ZMQ_LINGER, &linger, sizeof(linger));
+			zmq_close(stream);
+		}
+		if(metrics) {
+			zmq_setsockopt(metrics, ZMQ_LINGER, &linger, sizeof(linger));
+			zmq_close(metrics);
+		}
+		zmq_setsockopt(responder, ZMQ_LINGER, &linger, sizeof(linger));
 		zmq_close(responder);
 		zmq_ctx_destroy(context);
 		kill(pid, SIGUSR2);
 	}
-	usleep(100000);
 	return 0;
 }
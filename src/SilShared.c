@@ -12,17 +12,45 @@
 #include <fcntl.h>           /* For O_* constants */
 #include <unistd.h>
 #include <inttypes.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/ioctl.h>
 
 #include "../include/SilStruct.h"
 #include "../include/ShellColors.h"
 
-struct Silshared *shm_request(const char *memname, const int create) {
+static int spoolfd = -1; // spool file, opened before the fork and shared by every process of the server
+static int spooled = 0;  // producer side: the spool holds events
+static size_t shmsize = sizeof(struct Silshared); // shared file and mapping size (whole huge pages with huge = 1)
+
+#define SILPI_HUGE (2UL << 20)
+
+//kB of the shared ring mapped through huge pages (-1 if unknown)
+static long shm_hugekb(void) {
+	char line[200];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	
+	if(f == NULL) return -1;
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "ShmemPmdMapped: %ld", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb;
+}
+
+//huge = 1: the file is rounded to whole 2 MB pages and mapped at a 2 MB boundary with MADV_HUGEPAGE
+//(shmem huge pages, /sys/kernel/mm/transparent_hugepage/shmem_enabled = advise), the ring is pre-faulted anyway
+struct Silshared *shm_request(const char *memname, const int create, const int huge) {
 	int fd;
 	struct stat statbuf;
 	struct Silshared *buf = NULL;
+	char *addr = NULL, *area = MAP_FAILED;
+	size_t i;
+	long kb;
 	
+	shmsize = huge ? (sizeof(struct Silshared) + SILPI_HUGE - 1) & ~(SILPI_HUGE - 1) : sizeof(struct Silshared);
 	if(create) {
 		fd = shm_open(memname, O_RDWR|O_CREAT|O_EXCL, 0644);
 		if(fd < 0 && errno == EEXIST) {
@@ -39,7 +67,7 @@ struct Silshared *shm_request(const char *memname, const int create) {
 	}
 	
 	if(create) {
-		if(ftruncate(fd, sizeof(struct Silshared))) {
+		if(ftruncate(fd, shmsize)) {
 			perror(RED "ftruncate" NRM);
 			goto err;
 		}
@@ -49,18 +77,38 @@ struct Silshared *shm_request(const char *memname, const int create) {
 			perror(RED "fstat" NRM);
 			goto err;
 		}
-		if(statbuf.st_size != sizeof(struct Silshared)) {
+		if(statbuf.st_size != (off_t)shmsize) {
 			printf(RED "shm_get" NRM ": wrong shared file size\n");
 			goto err;
 		}
 	}
 	
-	buf = mmap(NULL, sizeof(struct Silshared), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(huge) {
+		//address space reserved with one huge page to spare, the mapping starts at the first boundary
+		area = mmap(NULL, shmsize + SILPI_HUGE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(area != MAP_FAILED) addr = (char *)(((uintptr_t)area + SILPI_HUGE - 1) & ~(SILPI_HUGE - 1));
+	}
+	buf = mmap(addr, shmsize, PROT_READ|PROT_WRITE, MAP_SHARED|(addr ? MAP_FIXED : 0), fd, 0);
 	if(buf == MAP_FAILED) {
-		perror(RED "fstat" NRM);
+		perror(RED "mmap" NRM);
+		if(area != MAP_FAILED) munmap(area, shmsize + SILPI_HUGE);
 		goto err;
 	}
-	if(create) memset(buf, 0, sizeof(struct Silshared));
+	if(addr) {
+		if(addr > area) munmap(area, addr - area);
+		munmap(addr + shmsize, area + shmsize + SILPI_HUGE - (addr + shmsize));
+	}
+	if(huge && madvise(buf, shmsize, MADV_HUGEPAGE)) perror(YEL "  shm_req" NRM);
+	if(close(fd)) perror(RED "close" NRM);
+	
+	//no page faults in the acquisition loop: the creator writes every page, the others read them
+	if(create) memset(buf, 0, shmsize);
+	else for(i=0; i<shmsize; i+=4096) (void)((volatile const char *)buf)[i];
+	if(huge) {
+		kb = shm_hugekb();
+		if(kb < 0) printf(YEL "  shm_req" NRM ": huge pages requested, mapping unknown\n");
+		else printf("%s  shm_req" NRM ": %ld kB of %lu kB in huge pages\n", (kb > 0) ? BLD : YEL, kb, (unsigned long)(shmsize >> 10));
+	}
 	return buf;
 	
 	err:
@@ -70,8 +118,338 @@ struct Silshared *shm_request(const char *memname, const int create) {
 }
 
 void shm_release(struct Silshared *buf, const char *memname, const int shunlink) {
-	if(munmap(buf, sizeof(struct Silshared))) perror(RED "munmap" NRM);
+	if(munmap(buf, shmsize)) perror(RED "munmap" NRM);
 	if(shunlink) {
 		if(shm_unlink(memname)) perror(RED "shm_unlink" NRM);
 	}
 }
+
+//sets and clears flags in a single atomic step, returns the old flags
+int shm_flags(struct Silshared *buf, const int set, const int clear) {
+	int old = __atomic_load_n(&(buf->flags), __ATOMIC_RELAXED);
+	
+	while(!__atomic_compare_exchange_n(&(buf->flags), &old, (old | set) & ~clear, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return old;
+}
+
+//consumer side: takes a free cursor at the current head, returns its index (-1 if none is free)
+int shm_attach(struct Silshared *buf, const int policy) {
+	int i;
+	
+	for(i=0; i<SILPI_MAXCONS; i++) {
+		if(__atomic_load_n(&(buf->cons[i].policy), __ATOMIC_ACQUIRE)) continue;
+		__atomic_store_n(&(buf->cons[i].pos), __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+		__atomic_store_n(&(buf->cons[i].dropped), 0, __ATOMIC_RELAXED);
+		//the producer sees the cursor only with its position set
+		__atomic_store_n(&(buf->cons[i].policy), policy, __ATOMIC_RELEASE);
+		return i;
+	}
+	return -1;
+}
+
+//consumer side: gives the cursor back, its events no longer hold the producer
+void shm_detach(struct Silshared *buf, const int id) {
+	__atomic_store_n(&(buf->cons[id].policy), 0, __ATOMIC_RELEASE);
+}
+
+//producer side: a DROP consumer before limit is moved there, its events in between are lost
+//the exchange fails if the consumer moved in the meantime: pos is reloaded and checked again
+static uint64_t shm_drop(struct Silcursor *cur, uint64_t pos, const uint64_t limit) {
+	while(pos < limit) {
+		if(__atomic_compare_exchange_n(&(cur->pos), &pos, limit, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&(cur->dropped), cur->dropped + (limit - pos), __ATOMIC_RELAXED);
+			pos = limit;
+		}
+	}
+	return pos;
+}
+
+//producer side: free slots, that is the ones already read (or spilled) for every consumer
+//a DROP consumer more than SIZE/2 events behind is moved forward (its oldest events are lost)
+uint32_t shm_free(struct Silshared *buf) {
+	uint64_t head = buf->head, pos, minpos = head, limit = (head > SIZE / 2) ? head - SIZE / 2 : 0, spill = buf->spill;
+	struct Silcursor *cur;
+	int policy;
+	
+	for(cur = buf->cons; cur < buf->cons + SILPI_MAXCONS; cur++) {
+		policy = __atomic_load_n(&(cur->policy), __ATOMIC_ACQUIRE);
+		if(policy == 0) continue;
+		pos = __atomic_load_n(&(cur->pos), __ATOMIC_ACQUIRE);
+		if(policy == SILPI_CONS_DROP) pos = shm_drop(cur, pos, limit);
+		if(pos < spill) pos = spill;
+		if(pos < minpos) minpos = pos;
+	}
+	return SIZE - (uint32_t)(head - minpos);
+}
+
+//events held in the ring (read only, unlike shm_free: consumers can call it)
+uint32_t shm_used(struct Silshared *buf) {
+	uint64_t head = __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE), pos, minpos = head;
+	uint64_t spill = __atomic_load_n(&(buf->spill), __ATOMIC_ACQUIRE);
+	struct Silcursor *cur;
+	
+	for(cur = buf->cons; cur < buf->cons + SILPI_MAXCONS; cur++) {
+		if(__atomic_load_n(&(cur->policy), __ATOMIC_ACQUIRE) == 0) continue;
+		pos = __atomic_load_n(&(cur->pos), __ATOMIC_ACQUIRE);
+		if(pos < spill) pos = spill;
+		if(pos < minpos) minpos = pos;
+	}
+	return (head - minpos > SIZE) ? SIZE : (uint32_t)(head - minpos);
+}
+
+//producer side: the last n events stored in the ring go to the spectrum and a new version is published
+//(a clear requested by the 0MQ server is done first), anchors and other records are skipped
+//paused (ns) is a pause of the acquisition inside the spectrum time window: it is dead time
+void shm_spectrum(struct Silshared *buf, const uint32_t n, const uint64_t paused) {
+	struct Silspecshm *sp = &(buf->specs);
+	struct Silevent *ev;
+	uint64_t pos, head = buf->head, version = sp->version + 1;
+	uint64_t events = sp->spec.events, errors = sp->spec.errors, tstart = sp->spec.tstart, tstop = sp->spec.tstop, dead = sp->spec.dead;
+	
+	if(__atomic_load_n(&(sp->clear), __ATOMIC_ACQUIRE)) {
+		memset(sp->spec.bins, 0, sizeof(sp->spec.bins));
+		events = errors = tstart = tstop = dead = 0;
+		__atomic_store_n(&(sp->reset), version, __ATOMIC_RELAXED);
+		__atomic_store_n(&(sp->clear), 0, __ATOMIC_RELAXED);
+	}
+	else if(n == 0 && paused == 0) return;
+	if(events) dead += paused; //not after a clear during the pause: the window starts after it
+	
+	for(pos = head - n; pos < head; pos++) {
+		ev = buf->buffer + pos % SIZE;
+		if(ev->type != SILPI_REC_EVENT) continue;
+		__atomic_store_n(&(sp->spec.bins[ev->val]), sp->spec.bins[ev->val] + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&(sp->ver[ev->val]), (uint32_t)version, __ATOMIC_RELAXED);
+		if(events == 0) tstart = ev->ts;
+		tstop = ev->ts + ev->dt;
+		dead += ev->dt;
+		if(ev->emask) errors++;
+		events++;
+	}
+	__atomic_store_n(&(sp->spec.events), events, __ATOMIC_RELAXED);
+	__atomic_store_n(&(sp->spec.errors), errors, __ATOMIC_RELAXED);
+	__atomic_store_n(&(sp->spec.tstart), tstart, __ATOMIC_RELAXED);
+	__atomic_store_n(&(sp->spec.tstop), tstop, __ATOMIC_RELAXED);
+	__atomic_store_n(&(sp->spec.dead), dead, __ATOMIC_RELAXED);
+	//the bins of this version are visible to whoever reads it
+	__atomic_store_n(&(sp->version), version, __ATOMIC_RELEASE);
+}
+
+//spool file for the events that do not fit in the ring (-1 = none: the acquisition pauses instead)
+void shm_spool(const int fd) {
+	spoolfd = fd;
+}
+
+//producer side: when a BLOCK consumer lags by 3/4 of the ring, the oldest events it has not read go to
+//the spool file (offset = (stream position - spoolbase) * event size) and the ring is freed down to half of its size
+//DROP consumers are never spooled: the ones behind lose their oldest events, as in shm_free
+//the spool is emptied once every BLOCK consumer has read it back, the next spill starts it again at offset 0
+//returns the number of events spilled (-1 on write errors)
+int shm_spill(struct Silshared *buf) {
+	uint64_t head = buf->head, spill = buf->spill, base = buf->spoolbase, from = head, pos, target;
+	uint32_t n, idx, first;
+	struct Silcursor *cur;
+	const size_t sz = sizeof(struct Silevent);
+	
+	if(spoolfd < 0) return 0;
+	for(cur = buf->cons; cur < buf->cons + SILPI_MAXCONS; cur++) {
+		if(__atomic_load_n(&(cur->policy), __ATOMIC_ACQUIRE) != SILPI_CONS_BLOCK) continue;
+		pos = __atomic_load_n(&(cur->pos), __ATOMIC_ACQUIRE);
+		if(pos < from) from = pos;
+	}
+	
+	//nobody reads the spool any more (cursors only grow and new ones start at head): blocks are released
+	if(from >= spill && spooled) {
+		if(ftruncate(spoolfd, 0)) perror(YEL "shm_spill" NRM);
+		spooled = 0;
+	}
+	
+	if(from < spill) from = spill;
+	if(head < SIZE / 2 || head - from < SIZE - SIZE / 4) return 0;
+	target = head - SIZE / 2;
+	
+	//before the spill moves: a DROP consumer never finds its position in the spool
+	for(cur = buf->cons; cur < buf->cons + SILPI_MAXCONS; cur++) {
+		if(__atomic_load_n(&(cur->policy), __ATOMIC_ACQUIRE) != SILPI_CONS_DROP) continue;
+		shm_drop(cur, __atomic_load_n(&(cur->pos), __ATOMIC_ACQUIRE), target);
+	}
+	
+	//empty spool (new or truncated): the file starts again at this position, it does not grow with the stream
+	//nobody reads it now, the new base is visible with the spill position below
+	if(!spooled) {
+		base = from;
+		__atomic_store_n(&(buf->spoolbase), base, __ATOMIC_RELAXED);
+	}
+	n = (uint32_t)(target - from);
+	idx = from % SIZE;
+	first = SIZE - idx;
+	if(first > n) first = n;
+	if(pwrite(spoolfd, buf->buffer + idx, first * sz, (off_t)((from - base) * sz)) != (ssize_t)(first * sz) || pwrite(spoolfd, buf->buffer, (n - first) * sz, (off_t)((from - base + first) * sz)) != (ssize_t)((n - first) * sz)) {
+		perror(RED "shm_spill" NRM);
+		return -1;
+	}
+	spooled = 1;
+	__atomic_store_n(&(buf->spill), target, __ATOMIC_RELEASE);
+	//the slots are overwritten only after the new spill position is visible (see shm_read)
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return (int)n;
+}
+
+//consumer side: stored events (in the ring or in the spool) not read yet by consumer id
+uint32_t shm_count(struct Silshared *buf, const int id) {
+	uint64_t pos = __atomic_load_n(&(buf->cons[id].pos), __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE);
+	
+	if(pos > head) return 0; //the producer moved the cursor after head was loaded
+	if(head - pos > UINT32_MAX) return UINT32_MAX;
+	return (uint32_t)(head - pos);
+}
+
+//consumer side: copies up to max events to dst without moving the cursor, spooled ones first
+//returns the number of events, *from is the stream position of the first one
+//0 is returned also when the producer dropped the events during the copy (see shm_free): the call can be repeated
+uint32_t shm_peek(struct Silshared *buf, const int id, struct Silevent *dst, const uint32_t max, uint64_t *from) {
+	uint64_t pos = __atomic_load_n(&(buf->cons[id].pos), __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE);
+	uint64_t spill = __atomic_load_n(&(buf->spill), __ATOMIC_ACQUIRE), start;
+	uint32_t spooled = 0, count, idx, first;
+	const size_t sz = sizeof(struct Silevent);
+	
+	if(pos < spill && spoolfd >= 0) {
+		//events that left the ring are read back from the spool, in order (the base is stored before the spill)
+		spooled = (spill - pos > max) ? max : (uint32_t)(spill - pos);
+		if(pread(spoolfd, dst, spooled * sz, (off_t)((pos - __atomic_load_n(&(buf->spoolbase), __ATOMIC_RELAXED)) * sz)) != (ssize_t)(spooled * sz)) {
+			perror(RED "shm_peek" NRM);
+			return 0;
+		}
+	}
+	
+	start = pos + spooled;
+	count = (start >= head) ? 0 : ((head - start > SIZE) ? SIZE : (uint32_t)(head - start));
+	if(count > max - spooled) count = max - spooled;
+	idx = start % SIZE;
+	first = SIZE - idx;
+	if(first > count) first = count;
+	memcpy(dst + spooled, buf->buffer + idx, first * sz);
+	memcpy(dst + spooled + first, buf->buffer, (count - first) * sz);
+	
+	//a spill during the copy may have released these slots: they are read again from the spool
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(buf->spill), __ATOMIC_ACQUIRE) > start) count = 0;
+	
+	//if the producer moved the cursor, the slots may have been overwritten and the copy is discarded
+	*from = pos;
+	if(__atomic_load_n(&(buf->cons[id].pos), __ATOMIC_ACQUIRE) != pos) return 0;
+	return spooled + count;
+}
+
+//consumer side: events before pos have been delivered, their slots are given back to the producer
+//(the cursor never moves backwards, nor beyond head)
+void shm_ack(struct Silshared *buf, const int id, uint64_t pos) {
+	uint64_t cur = __atomic_load_n(&(buf->cons[id].pos), __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE);
+	
+	if(pos > head) pos = head;
+	while(cur < pos && !__atomic_compare_exchange_n(&(buf->cons[id].pos), &cur, pos, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+//consumer side: moves up to max events to dst, spooled ones first, returns the number of events
+//0 is returned also when the producer dropped the events during the copy (see shm_free): the call can be repeated
+uint32_t shm_read(struct Silshared *buf, const int id, struct Silevent *dst, const uint32_t max) {
+	uint64_t first;
+	uint32_t count = shm_peek(buf, id, dst, max, &first);
+	
+	//slots are given back to the producer only after the copy (unless the producer moved the cursor meanwhile)
+	if(count && __atomic_compare_exchange_n(&(buf->cons[id].pos), &first, first + count, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return count;
+	return 0;
+}
+
+//consumer side: skips every stored event
+void shm_flush(struct Silshared *buf, const int id) {
+	__atomic_store_n(&(buf->cons[id].pos), __atomic_load_n(&(buf->head), __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+struct Silring *dev_map(const int fd) {
+	size_t len;
+	struct Silring *ring;
+	
+	//header is mapped first, in order to know the ring size
+	ring = mmap(NULL, sizeof(struct Silring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ring == MAP_FAILED) {
+		perror(YEL "dev_map" NRM);
+		return NULL;
+	}
+	len = (size_t)(ring->offset) + (size_t)(ring->size) * sizeof(struct Silevent);
+	if(munmap(ring, sizeof(struct Silring))) perror(RED "munmap" NRM);
+	
+	ring = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ring == MAP_FAILED) {
+		perror(YEL "dev_map" NRM);
+		return NULL;
+	}
+	return ring;
+}
+
+void dev_unmap(struct Silring *ring) {
+	size_t len = (size_t)(ring->offset) + (size_t)(ring->size) * sizeof(struct Silevent);
+	if(munmap(ring, len)) perror(RED "munmap" NRM);
+}
+
+//moves up to max events from the device to buffer, returns the number of events (-1 on error)
+//if the ring is mapped no system call is needed, unless the driver is waiting for free slots
+int dev_read(const int fd, struct Silring *ring, struct Silevent *buffer, const int max) {
+	ssize_t n;
+	uint32_t read_idx, write_idx, count, first;
+	const struct Silevent *events;
+	
+	if(ring == NULL) {
+		n = read(fd, buffer, max * sizeof(struct Silevent));
+		if(n < 0) return -1;
+		if(n % sizeof(struct Silevent)) {
+			printf(YEL "dev_read" NRM ": read fraction of event (size = %ld)\n", (long int)n);
+		}
+		return (int)(n / sizeof(struct Silevent));
+	}
+	
+	events    = (const struct Silevent *)((const char *)ring + ring->offset);
+	read_idx  = ring->read_idx;
+	write_idx = __atomic_load_n(&(ring->write_idx), __ATOMIC_ACQUIRE);
+	
+	count = (write_idx + ring->size - read_idx) % ring->size;
+	if(count > (uint32_t)max) count = (uint32_t)max;
+	first = ring->size - read_idx;
+	if(first > count) first = count;
+	memcpy(buffer, events + read_idx, first * sizeof(struct Silevent));
+	memcpy(buffer + first, events, (count - first) * sizeof(struct Silevent));
+	
+	//slots are given back to the driver only after the copy
+	__atomic_store_n(&(ring->read_idx), (read_idx + count) % ring->size, __ATOMIC_RELEASE);
+	
+	if(__atomic_load_n(&(ring->hanged), __ATOMIC_ACQUIRE)) {
+		if(ioctl(fd, SILPI_IOC_RECOVER)) perror(RED "ioctl" NRM);
+	}
+	return (int)count;
+}
+
+//producer side: moves events from the device straight into the free slots of the shared ring
+//(two segments when it wraps), returns the number of events (-1 on error)
+int dev_to_shm(const int fd, struct Silring *ring, struct Silshared *buf) {
+	uint64_t head = buf->head;
+	uint32_t nfree = shm_free(buf), idx = head % SIZE, first = SIZE - idx;
+	int n, m = 0;
+	
+	if(nfree == 0) return 0;
+	if(first > nfree) first = nfree;
+	n = dev_read(fd, ring, buf->buffer + idx, (int)first);
+	if(n < 0) return -1;
+	
+	//the second segment is read only if the first one has been filled up
+	if((uint32_t)n == first && nfree > first) {
+		m = dev_read(fd, ring, buf->buffer, (int)(nfree - first));
+		if(m < 0) m = 0; //events of the first segment are kept, the error shows up again at next call
+	}
+	
+	//events must be visible before the new head
+	__atomic_store_n(&(buf->head), head + (uint64_t)(n + m), __ATOMIC_RELEASE);
+	return n + m;
+}